@@ -0,0 +1,113 @@
+#ifndef ACK_WINDOW_H
+#define ACK_WINDOW_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+
+#include "payload.h"
+
+// At-least-once (QoS 1) bookkeeping of one subscriber. Every message sent
+// gets the next sequence number, from 1 up, and is kept until an ACK covers
+// it; at most `limit` are unacknowledged at a time, and the rest wait here,
+// unsequenced, for the window to open. Not thread-safe: only the shard that
+// owns the connection touches it.
+//
+// Unacknowledged frames sit in send order in a deque, each costing a frame
+// reference and a timestamp: sending and a cumulative ACK are O(1) per
+// message. A timeout resends the whole window (go-back-N), which keeps the
+// send times in order, so whether anything timed out is a look at the
+// oldest one.
+class AckWindow {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    bool enabled() const { return on; }
+
+    // Keeps the limit set before, if any.
+    void enable(size_t default_limit) {
+        on = true;
+        if (window == 0) window = default_limit;
+    }
+
+    // Whatever was unacknowledged counts as acknowledged; waiting frames
+    // are the caller's to take.
+    void disable() {
+        on = false;
+        base += unacked.size();
+        unacked.clear();
+    }
+
+    size_t limit() const { return window; }
+    void set_limit(size_t limit) { window = limit; }
+
+    bool full() const { return unacked.size() >= window; }
+    uint64_t next_sequence() const { return base + unacked.size(); }
+
+    // frame, carrying next_sequence(), went out at now.
+    void sent(PayloadRef frame, Clock::time_point now) { unacked.push_back({std::move(frame), now}); }
+
+    // Everything up to seq arrived. Returns false if seq was never sent.
+    bool ack(uint64_t seq) {
+        if (seq >= next_sequence()) return false;
+        while (base <= seq) {
+            unacked.pop_front();
+            base++;
+        }
+        return true;
+    }
+
+    bool expired(Clock::time_point now, Clock::duration timeout) const {
+        return !unacked.empty() && now - unacked.front().sent >= timeout;
+    }
+
+    // Calls fn on every unacknowledged frame, oldest first, to send it again.
+    template <typename F>
+    void resend(Clock::time_point now, F &&fn) {
+        for (Unacked &entry : unacked) {
+            entry.sent = now;
+            fn(entry.frame);
+        }
+        resends += unacked.size();
+    }
+
+    // Frames waiting for the window to open.
+    void wait(PayloadRef frame) { waiting.push_back(std::move(frame)); }
+    bool has_waiting() const { return !waiting.empty(); }
+    size_t waiting_count() const { return waiting.size(); }
+
+    PayloadRef take_waiting() {
+        PayloadRef frame = std::move(waiting.front());
+        waiting.pop_front();
+        return frame;
+    }
+
+    void drop_oldest_waiting() {
+        waiting.pop_front();
+        drops++;
+    }
+
+    void drop_newest() { drops++; }
+
+    // Sent but unacknowledged, plus waiting.
+    size_t outstanding() const { return unacked.size() + waiting.size(); }
+    uint64_t dropped() const { return drops; }
+    uint64_t redelivered() const { return resends; }
+
+private:
+    struct Unacked {
+        PayloadRef frame;
+        Clock::time_point sent;
+    };
+
+    std::deque<Unacked> unacked;
+    std::deque<PayloadRef> waiting;
+    // Sequence number of unacked.front().
+    uint64_t base = 1;
+    bool on = false;
+    size_t window = 0;
+    uint64_t drops = 0;
+    uint64_t resends = 0;
+};
+
+#endif // ACK_WINDOW_H
@@ -0,0 +1,101 @@
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Length-prefixed framing a connection can switch to with the text command
+// "PROTOCOL BINARY". Payloads are raw bytes (newlines included) and the
+// receiver finds the end of a frame from its header instead of scanning.
+//
+// Every frame is a 12-byte header followed by `length` payload bytes, all
+// integers big-endian:
+//
+//   byte 0     opcode
+//   byte 1     flags
+//   bytes 2-3  reserved, zero
+//   bytes 4-7  topic id
+//   bytes 8-11 payload length
+//
+// Topic names are interned to ids by the broker. A Topic frame announces
+// an id to a connection before the first frame that uses it, and a client
+// may publish by id from then on instead of repeating the name.
+enum class Opcode : uint8_t {
+    // Client to broker.
+    Command = 1,  // payload is a text command (SUBSCRIBE, CONFIG, ...)
+    Publish = 2,  // payload is the message for topic id; with id 0 it is
+                  // a 2-byte name length, the name, then the message
+    // Broker to client.
+    Reply = 3,    // payload is the text reply to a Command
+    Ack = 4,      // a Publish to topic id was accepted
+    Topic = 5,    // payload is the name of topic id
+    Message = 6,  // payload is a message published to topic id
+};
+
+// Ack/Message: the payload starts with the 8-byte log offset.
+constexpr uint8_t FLAG_LOGGED = 0x1;
+// Ack: the message reached nobody; no one was subscribed, or no WHERE
+// condition held for it.
+constexpr uint8_t FLAG_NO_SUBSCRIBERS = 0x2;
+// Message: the topic's retained last value, sent on SUBSCRIBE.
+constexpr uint8_t FLAG_RETAINED = 0x4;
+// Message: an at-least-once delivery; the payload starts with the 8-byte
+// sequence number to ACK, ahead of the log offset if there is one.
+constexpr uint8_t FLAG_SEQUENCED = 0x8;
+
+constexpr size_t FRAME_HEADER_SIZE = 12;
+
+struct FrameHeader {
+    Opcode opcode;
+    uint8_t flags = 0;
+    uint32_t topic_id = 0;
+    uint32_t length = 0;
+};
+
+inline void put_u16(char *out, uint16_t v) {
+    out[0] = (char)(v >> 8);
+    out[1] = (char)v;
+}
+
+inline void put_u32(char *out, uint32_t v) {
+    for (int i = 0; i < 4; i++) out[i] = (char)(v >> (24 - 8 * i));
+}
+
+inline void put_u64(char *out, uint64_t v) {
+    for (int i = 0; i < 8; i++) out[i] = (char)(v >> (56 - 8 * i));
+}
+
+inline uint16_t get_u16(const char *in) {
+    return (uint16_t)((uint8_t)in[0] << 8 | (uint8_t)in[1]);
+}
+
+inline uint32_t get_u32(const char *in) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v = v << 8 | (uint8_t)in[i];
+    return v;
+}
+
+inline uint64_t get_u64(const char *in) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = v << 8 | (uint8_t)in[i];
+    return v;
+}
+
+inline void encode_frame_header(char *out, const FrameHeader &h) {
+    out[0] = (char)h.opcode;
+    out[1] = (char)h.flags;
+    put_u16(out + 2, 0);
+    put_u32(out + 4, h.topic_id);
+    put_u32(out + 8, h.length);
+}
+
+inline FrameHeader decode_frame_header(const char *in) {
+    FrameHeader h;
+    h.opcode = (Opcode)in[0];
+    h.flags = (uint8_t)in[1];
+    h.topic_id = get_u32(in + 4);
+    h.length = get_u32(in + 8);
+    return h;
+}
+
+#endif // BINARY_PROTOCOL_H
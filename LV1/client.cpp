@@ -1,14 +1,95 @@
 #include <iostream>
+#include <fstream>
+#include <iterator>
 #include <string>
 #include <thread>
+#include <map>
+#include <cstdlib>
 #include <cstring>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+#include "pubsub_client.h"
+
 constexpr int PORT = 8080;
 constexpr int BUFFER_SIZE = 4096;
 
+void print_server(const std::string &text) {
+    std::cout << "\n[SERVER] " << text << "\n> " << std::flush;
+}
+
+void print_message(const PubSubMessage &m) {
+    std::string text = "[" + std::string(m.topic);
+    if (m.logged) text += "@" + std::to_string(m.offset);
+    text += "] " + std::string(m.payload);
+    if (m.retained) text += " (retained)";
+    print_server(text);
+}
+
+// --binary: the REPL on top of PubSubClient, which reconnects and subscribes
+// again by itself. PUBLISH <topic> <message> and PUBFILE <topic> <path> (a
+// file's raw bytes) are queued publishes; a plain SUBSCRIBE or UNSUBSCRIBE
+// <filter> is a client subscription. Anything else is sent as typed.
+int run_binary(int port) {
+    PubSubClientOptions options;
+    options.port = port;
+    options.on_connection = [port](bool up) {
+        if (up) print_server("Connected to server at 127.0.0.1:" + std::to_string(port));
+        else print_server("Connection lost; reconnecting");
+    };
+    options.on_reply = [](std::string_view reply) { print_server(std::string(reply)); };
+    options.on_unrouted = print_message;
+    PubSubClient client(options);
+    std::map<std::string, uint64_t> subscribed;
+
+    while (true) {
+        std::cout << "> " << std::flush;
+        std::string line;
+        if (!std::getline(std::cin, line)) break;
+
+        if (line == "exit" || line == "quit") {
+            std::cout << "Closing client.\n";
+            break;
+        }
+        if (line.empty()) continue;
+
+        size_t p = line.find(' ');
+        std::string cmd = line.substr(0, p);
+        std::string arg = p == std::string::npos ? "" : line.substr(p + 1);
+        size_t q = arg.find(' ');
+        std::string topic = arg.substr(0, q);
+        std::string rest = q == std::string::npos ? "" : arg.substr(q + 1);
+
+        if ((cmd == "PUBLISH" || cmd == "PUBFILE") && q != std::string::npos) {
+            std::string message = rest;
+            if (cmd == "PUBFILE") {
+                std::ifstream file(rest, std::ios::binary);
+                if (!file) {
+                    std::cout << "Cannot read " << rest << "\n";
+                    continue;
+                }
+                message.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            }
+            if (!client.publish(topic, std::move(message))) std::cout << "Cannot publish to '" << topic << "'\n";
+        } else if (cmd == "SUBSCRIBE" && !topic.empty() && q == std::string::npos) {
+            if (subscribed.count(topic)) {
+                std::cout << "Already subscribed to " << topic << "\n";
+                continue;
+            }
+            uint64_t id = client.subscribe(topic, print_message);
+            if (id == 0) std::cout << "Invalid topic filter '" << topic << "'\n";
+            else subscribed[topic] = id;
+        } else if (cmd == "UNSUBSCRIBE" && subscribed.count(arg)) {
+            client.unsubscribe(subscribed[arg]);
+            subscribed.erase(arg);
+        } else {
+            client.command(line);
+        }
+    }
+    return 0;
+}
+
 void listener_thread_fn(int sockfd) {
     char buf[BUFFER_SIZE];
     std::string backlog;
@@ -33,7 +114,21 @@ void listener_thread_fn(int sockfd) {
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    bool binary = false;
+    int port = PORT;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--binary") {
+            binary = true;
+        } else if (std::string(argv[i]) == "--port" && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--binary] [--port PORT]\n";
+            return 1;
+        }
+    }
+    if (binary) return run_binary(port);
+
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("socket");
@@ -42,7 +137,7 @@ int main() {
 
     sockaddr_in serv{};
     serv.sin_family = AF_INET;
-    serv.sin_port = htons(PORT);
+    serv.sin_port = htons(port);
     if (inet_pton(AF_INET, "127.0.0.1", &serv.sin_addr) <= 0) {
         perror("inet_pton");
         close(sockfd);
@@ -55,7 +150,7 @@ int main() {
         return 1;
     }
 
-    std::cout << "Connected to server at 127.0.0.1:" << PORT << "\n";
+    std::cout << "Connected to server at 127.0.0.1:" << port << "\n";
     std::thread listener(listener_thread_fn, sockfd);
     listener.detach();
 
@@ -69,10 +164,8 @@ int main() {
             break;
         }
 
-        std::string out = line;
-        if (out.empty()) continue;
-        if (out.back() != '\n') out.push_back('\n');
-
+        if (line.empty()) continue;
+        std::string out = line + "\n";
         ssize_t s = send(sockfd, out.c_str(), out.size(), 0);
         if (s <= 0) {
             perror("send");
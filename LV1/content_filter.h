@@ -0,0 +1,296 @@
+#ifndef CONTENT_FILTER_H
+#define CONTENT_FILTER_H
+
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The condition of a SUBSCRIBE ... WHERE: which messages of the topic the
+// subscriber wants.
+//
+//   expr    := term { OR term }
+//   term    := factor { AND factor }
+//   factor  := NOT factor | ( expr ) | operand op value
+//   operand := payload | <field>
+//   op      := = | != | < | <= | > | >= | STARTSWITH | ENDSWITH | CONTAINS
+//   value   := "quoted string" | word
+//
+// A field is a name=value token of the message, tokens being separated by
+// spaces; any comparison with a field the message lacks is false. The
+// ordering operators compare as numbers when both sides are numbers, as
+// strings otherwise.
+//
+// An expression is compiled once, at SUBSCRIBE, into a tree that is
+// immutable from then on, so every shard can run it. Its canonical text
+// (fully parenthesised, values quoted) identifies it: subscriptions whose
+// conditions only differ in spacing share one filter.
+class ContentFilter {
+public:
+    static constexpr size_t MAX_NODES = 256;
+    static constexpr int MAX_DEPTH = 32;
+
+    // Null, with error set, if expr does not parse.
+    static std::shared_ptr<const ContentFilter> compile(std::string_view expr, std::string &error) {
+        auto filter = std::make_shared<ContentFilter>();
+        Parser parser{expr, *filter, error};
+        int root = parser.parse_expr(0);
+        if (root >= 0 && parser.peek().kind != Token::End) root = parser.fail("unexpected '" + std::string(parser.peek().text) + "'");
+        if (root < 0) return nullptr;
+        filter->root = root;
+        filter->canonical = filter->print(root);
+        return filter;
+    }
+
+    bool matches(std::string_view message) const { return eval(root, message); }
+
+    const std::string &text() const { return canonical; }
+
+private:
+    enum class Op : uint8_t { And, Or, Not, Eq, Ne, Lt, Le, Gt, Ge, StartsWith, EndsWith, Contains };
+
+    struct Node {
+        Op op = Op::Eq;
+        // Children of And, Or (both) and Not (left).
+        int left = -1;
+        int right = -1;
+        // Comparisons: the field, or the whole message if payload is set.
+        bool payload = false;
+        std::string field;
+        std::string value;
+        bool numeric = false;
+        double number = 0;
+    };
+
+    struct Token {
+        enum Kind { End, Word, String, Symbol, Open, Close, Bad } kind;
+        std::string_view text;
+    };
+
+    struct Parser {
+        std::string_view in;
+        ContentFilter &out;
+        std::string &error;
+        size_t pos = 0;
+
+        int fail(std::string message) {
+            if (error.empty()) error = std::move(message);
+            return -1;
+        }
+
+        Token peek() {
+            size_t save = pos;
+            Token token = next();
+            pos = save;
+            return token;
+        }
+
+        Token next() {
+            while (pos < in.size() && in[pos] == ' ') pos++;
+            if (pos == in.size()) return {Token::End, {}};
+            size_t start = pos;
+            char c = in[pos];
+            if (c == '(' || c == ')') {
+                pos++;
+                return {c == '(' ? Token::Open : Token::Close, in.substr(start, 1)};
+            }
+            if (c == '"') {
+                // Kept with its quotes; unquote() resolves the escapes.
+                for (pos++; pos < in.size() && in[pos] != '"'; pos++) {
+                    if (in[pos] == '\\') pos++;
+                }
+                if (pos >= in.size()) return {Token::Bad, in.substr(start)};
+                pos++;
+                return {Token::String, in.substr(start, pos - start)};
+            }
+            if (c == '=' || c == '!' || c == '<' || c == '>') {
+                pos++;
+                if (pos < in.size() && in[pos] == '=') pos++;
+                return {Token::Symbol, in.substr(start, pos - start)};
+            }
+            while (pos < in.size() && std::string_view(" ()\"=!<>").find(in[pos]) == std::string_view::npos) pos++;
+            return {Token::Word, in.substr(start, pos - start)};
+        }
+
+        int add(Node node) {
+            if (out.nodes.size() >= MAX_NODES) return fail("expression too long");
+            out.nodes.push_back(std::move(node));
+            return (int)out.nodes.size() - 1;
+        }
+
+        int add_branch(Op op, int left, int right = -1) {
+            Node node;
+            node.op = op;
+            node.left = left;
+            node.right = right;
+            return add(std::move(node));
+        }
+
+        int parse_expr(int depth) {
+            if (depth > MAX_DEPTH) return fail("expression nested too deeply");
+            int left = parse_term(depth);
+            while (left >= 0 && peek().kind == Token::Word && peek().text == "OR") {
+                next();
+                int right = parse_term(depth);
+                if (right < 0) return -1;
+                left = add_branch(Op::Or, left, right);
+            }
+            return left;
+        }
+
+        int parse_term(int depth) {
+            int left = parse_factor(depth);
+            while (left >= 0 && peek().kind == Token::Word && peek().text == "AND") {
+                next();
+                int right = parse_factor(depth);
+                if (right < 0) return -1;
+                left = add_branch(Op::And, left, right);
+            }
+            return left;
+        }
+
+        int parse_factor(int depth) {
+            if (depth > MAX_DEPTH) return fail("expression nested too deeply");
+            Token token = next();
+            if (token.kind == Token::Word && token.text == "NOT") {
+                int operand = parse_factor(depth + 1);
+                return operand < 0 ? -1 : add_branch(Op::Not, operand);
+            }
+            if (token.kind == Token::Open) {
+                int inner = parse_expr(depth + 1);
+                if (inner < 0) return -1;
+                if (next().kind != Token::Close) return fail("missing ')'");
+                return inner;
+            }
+            if (token.kind != Token::Word || is_keyword(token.text)) return fail(expected("a field or payload", token));
+
+            Node node;
+            node.payload = token.text == "payload";
+            if (!node.payload) node.field = std::string(token.text);
+
+            Token op = next();
+            if (!parse_op(op, node.op)) return fail(expected("an operator", op));
+            Token value = next();
+            if (value.kind == Token::String) node.value = unquote(value.text);
+            else if (value.kind == Token::Word && !is_keyword(value.text)) node.value = std::string(value.text);
+            else return fail(expected("a value", value));
+            node.numeric = parse_number(node.value, node.number);
+            return add(std::move(node));
+        }
+
+        static bool parse_op(const Token &token, Op &op) {
+            std::string_view t = token.text;
+            if (t == "=") op = Op::Eq;
+            else if (t == "!=") op = Op::Ne;
+            else if (t == "<") op = Op::Lt;
+            else if (t == "<=") op = Op::Le;
+            else if (t == ">") op = Op::Gt;
+            else if (t == ">=") op = Op::Ge;
+            else if (t == "STARTSWITH") op = Op::StartsWith;
+            else if (t == "ENDSWITH") op = Op::EndsWith;
+            else if (t == "CONTAINS") op = Op::Contains;
+            else return false;
+            return token.kind == Token::Symbol || token.kind == Token::Word;
+        }
+
+        static bool is_keyword(std::string_view word) {
+            return word == "AND" || word == "OR" || word == "NOT" || word == "STARTSWITH" || word == "ENDSWITH" ||
+                   word == "CONTAINS";
+        }
+
+        static std::string expected(const char *what, const Token &token) {
+            if (token.kind == Token::End) return std::string("expected ") + what + " at the end";
+            if (token.kind == Token::Bad) return "unterminated string";
+            return std::string("expected ") + what + ", got '" + std::string(token.text) + "'";
+        }
+
+        static std::string unquote(std::string_view quoted) {
+            std::string value;
+            for (size_t i = 1; i + 1 < quoted.size(); i++) {
+                if (quoted[i] == '\\') i++;
+                value += quoted[i];
+            }
+            return value;
+        }
+    };
+
+    static bool parse_number(std::string_view s, double &value) {
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+        return !s.empty() && ec == std::errc() && end == s.data() + s.size();
+    }
+
+    // The value of the first name=value token for field, if any.
+    static bool find_field(std::string_view message, std::string_view field, std::string_view &value) {
+        size_t pos = 0;
+        while (pos < message.size()) {
+            size_t end = message.find(' ', pos);
+            if (end == std::string_view::npos) end = message.size();
+            std::string_view token = message.substr(pos, end - pos);
+            if (token.size() > field.size() && token[field.size()] == '=' && token.substr(0, field.size()) == field) {
+                value = token.substr(field.size() + 1);
+                return true;
+            }
+            pos = end + 1;
+        }
+        return false;
+    }
+
+    bool eval(int i, std::string_view message) const {
+        const Node &node = nodes[i];
+        switch (node.op) {
+        case Op::And: return eval(node.left, message) && eval(node.right, message);
+        case Op::Or: return eval(node.left, message) || eval(node.right, message);
+        case Op::Not: return !eval(node.left, message);
+        default: break;
+        }
+
+        std::string_view subject = message;
+        if (!node.payload && !find_field(message, node.field, subject)) return false;
+        std::string_view value = node.value;
+        switch (node.op) {
+        case Op::Eq: return subject == value;
+        case Op::Ne: return subject != value;
+        case Op::StartsWith: return subject.substr(0, value.size()) == value;
+        case Op::EndsWith: return subject.size() >= value.size() && subject.substr(subject.size() - value.size()) == value;
+        case Op::Contains: return subject.find(value) != std::string_view::npos;
+        default: break;
+        }
+
+        int order;
+        double number;
+        if (node.numeric && parse_number(subject, number)) order = number < node.number ? -1 : number > node.number ? 1 : 0;
+        else order = subject.compare(value);
+        switch (node.op) {
+        case Op::Lt: return order < 0;
+        case Op::Le: return order <= 0;
+        case Op::Gt: return order > 0;
+        default: return order >= 0;
+        }
+    }
+
+    std::string print(int i) const {
+        static const char *const names[] = {"AND", "OR", "NOT", "=", "!=", "<", "<=", ">", ">=", "STARTSWITH", "ENDSWITH", "CONTAINS"};
+        const Node &node = nodes[i];
+        const char *name = names[(int)node.op];
+        if (node.op == Op::Not) return std::string("NOT ") + print(node.left);
+        if (node.op == Op::And || node.op == Op::Or) return "(" + print(node.left) + " " + name + " " + print(node.right) + ")";
+
+        std::string quoted = "\"";
+        for (char c : node.value) {
+            if (c == '"' || c == '\\') quoted += '\\';
+            quoted += c;
+        }
+        quoted += '"';
+        return (node.payload ? std::string("payload") : node.field) + " " + name + " " + quoted;
+    }
+
+    std::vector<Node> nodes;
+    int root = 0;
+    std::string canonical;
+};
+
+using ContentFilterPtr = std::shared_ptr<const ContentFilter>;
+
+#endif // CONTENT_FILTER_H
@@ -0,0 +1,104 @@
+#ifndef LINE_BUFFER_H
+#define LINE_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+// Input buffer of one connection for the newline-delimited protocol (and
+// for length-prefixed frames, through pending() and consume()).
+//
+// The socket is read straight into the free space at the tail and complete
+// lines are handed out as string_views into the buffer, so a command is
+// never copied between the read and its handler. The unconsumed start of
+// the buffer is reclaimed like a ring: once the tail reaches the end, the
+// partial line left over is moved back to the front (lines have to stay
+// contiguous to be viewed in place). The buffer only grows when a single
+// line does not fit, and is given back once nothing is pending, so idle
+// connections hold no input memory.
+//
+// Views returned by next_line() and pending() stay valid until the next
+// write_area().
+class LineBuffer {
+public:
+    static constexpr size_t INITIAL_SIZE = 4096;
+    static constexpr size_t MAX_SIZE = 4 * 1024 * 1024;
+
+    // Space to read into; empty if a single line already fills MAX_SIZE.
+    std::pair<char *, size_t> write_area() {
+        if (tail == cap) {
+            if (head > 0) {
+                std::memmove(buf.get(), buf.get() + head, tail - head);
+                tail -= head;
+                scan -= head;
+                head = 0;
+            } else if (cap < MAX_SIZE) {
+                size_t size = cap == 0 ? INITIAL_SIZE : std::min(cap * 2, MAX_SIZE);
+                std::unique_ptr<char[]> bigger(new char[size]);
+                if (tail > 0) std::memcpy(bigger.get(), buf.get(), tail);
+                buf = std::move(bigger);
+                cap = size;
+            }
+        }
+        return {buf.get() + tail, cap - tail};
+    }
+
+    void commit(size_t n) { tail += n; }
+
+    // Next complete line without its "\n" or "\r\n". Bytes already searched
+    // are not searched again when more of a long line arrives.
+    bool next_line(std::string_view &line) {
+        const char *nl = static_cast<const char *>(std::memchr(buf.get() + scan, '\n', tail - scan));
+        if (!nl) {
+            scan = tail;
+            return false;
+        }
+
+        size_t end = nl - buf.get();
+        size_t len = end - head;
+        if (len > 0 && buf[end - 1] == '\r') len--;
+        line = std::string_view(buf.get() + head, len);
+        head = scan = end + 1;
+        return true;
+    }
+
+    // Everything received and not yet consumed.
+    std::string_view pending() const { return std::string_view(buf.get() + head, tail - head); }
+
+    void consume(size_t n) {
+        head += n;
+        if (scan < head) scan = head;
+    }
+
+    // Drops the storage if no partial line is waiting for more bytes.
+    void release_if_empty() {
+        if (head != tail) return;
+        buf.reset();
+        cap = head = tail = scan = 0;
+    }
+
+private:
+    std::unique_ptr<char[]> buf;
+    size_t cap = 0;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t scan = 0;
+};
+
+// Splits the next space-separated token off the front of s.
+inline std::string_view next_token(std::string_view &s) {
+    size_t start = s.find_first_not_of(' ');
+    if (start == std::string_view::npos) {
+        s = std::string_view();
+        return s;
+    }
+    size_t end = s.find(' ', start);
+    std::string_view token = s.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+    s = end == std::string_view::npos ? std::string_view() : s.substr(end + 1);
+    return token;
+}
+
+#endif // LINE_BUFFER_H
@@ -0,0 +1,424 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Append-only, replayable log of every message published to one topic.
+//
+// A topic log is a directory of segment files, each named after the offset
+// of its first record. A segment is preallocated, memory-mapped, and filled
+// with records of the form
+//
+//     u32 magic | u32 size | u64 offset | size bytes of message
+//
+// Next to every segment sits a sparse index (.idx) with one (offset,
+// position) pair per LOG_INDEX_INTERVAL bytes, so a reader seeks to any
+// offset by binary search plus a short forward scan, then streams records
+// straight out of the mapping. Records below a segment's committed size
+// are immutable, so readers only take the log lock to locate a segment.
+constexpr uint32_t LOG_RECORD_MAGIC = 0x4d4c4f47; // "GOLM"
+constexpr size_t LOG_HEADER_SIZE = 16;
+constexpr size_t LOG_SEGMENT_SIZE = 16 * 1024 * 1024;
+constexpr size_t LOG_INDEX_INTERVAL = 4096;
+
+class TopicLog {
+    struct Segment;
+
+public:
+    // Sequential read position; keeps its segment mapped while in use.
+    struct Reader {
+        std::shared_ptr<Segment> segment;
+        size_t pos = 0;
+        uint64_t next = 0;
+    };
+
+    // Opens (or creates) the log stored in dir, recovering the end of the
+    // last segment after a restart.
+    bool open(const std::string &path) {
+        dir = path;
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror("mkdir");
+            return false;
+        }
+
+        std::vector<uint64_t> bases;
+        if (DIR *d = opendir(dir.c_str())) {
+            while (dirent *ent = readdir(d)) {
+                std::string name = ent->d_name;
+                if (name.size() == 24 && name.compare(20, 4, ".log") == 0) {
+                    bases.push_back(std::strtoull(name.c_str(), nullptr, 10));
+                }
+            }
+            closedir(d);
+        }
+        std::sort(bases.begin(), bases.end());
+
+        for (uint64_t base : bases) {
+            auto seg = open_segment(base, 0);
+            if (!seg) return false;
+            segments.push_back(seg);
+        }
+        if (segments.empty()) {
+            auto seg = open_segment(0, LOG_SEGMENT_SIZE);
+            if (!seg) return false;
+            segments.push_back(seg);
+        }
+        end = segments.back()->next_offset;
+        return true;
+    }
+
+    // Appends one message and returns its offset, or false on I/O error.
+    bool append(std::string_view message, uint64_t &offset) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t need = LOG_HEADER_SIZE + message.size();
+        Segment *seg = segments.back().get();
+        size_t size = seg->size.load(std::memory_order_relaxed);
+        if (size + need > seg->capacity) {
+            msync(seg->map, size, MS_ASYNC);
+            auto next = open_segment(end, std::max(LOG_SEGMENT_SIZE, need));
+            if (!next) return false;
+            segments.push_back(next);
+            seg = next.get();
+            size = 0;
+        }
+
+        offset = end;
+        uint32_t header[4];
+        header[0] = LOG_RECORD_MAGIC;
+        header[1] = (uint32_t)message.size();
+        std::memcpy(&header[2], &offset, sizeof(offset));
+        std::memcpy(seg->map + size, header, LOG_HEADER_SIZE);
+        std::memcpy(seg->map + size + LOG_HEADER_SIZE, message.data(), message.size());
+
+        if (seg->index.empty() || size - seg->index.back().pos >= LOG_INDEX_INTERVAL) {
+            IndexEntry entry{offset, size};
+            seg->index.push_back(entry);
+            if (write(seg->index_fd, &entry, sizeof(entry)) != (ssize_t)sizeof(entry)) perror("write index");
+        }
+
+        seg->next_offset = offset + 1;
+        seg->size.store(size + need, std::memory_order_release);
+        end = offset + 1;
+        return true;
+    }
+
+    uint64_t start_offset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return segments.front()->base;
+    }
+
+    uint64_t end_offset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return end;
+    }
+
+    // Positions a reader at offset, clamped to the retained range.
+    Reader seek(uint64_t offset) {
+        std::lock_guard<std::mutex> lock(mutex);
+        offset = std::min(std::max(offset, segments.front()->base), end);
+
+        auto it = std::upper_bound(segments.begin(), segments.end(), offset,
+                                   [](uint64_t off, const std::shared_ptr<Segment> &s) { return off < s->base; });
+        Reader reader;
+        reader.segment = *(it - 1);
+        reader.next = offset;
+
+        const auto &index = reader.segment->index;
+        auto ix = std::upper_bound(index.begin(), index.end(), offset,
+                                   [](uint64_t off, const IndexEntry &e) { return off < e.offset; });
+        if (ix != index.begin()) {
+            reader.pos = (ix - 1)->pos;
+            skip_to(reader, offset);
+        }
+        return reader;
+    }
+
+    // Calls fn(offset, message) for up to max records from the reader's
+    // position and returns how many were read.
+    template <typename F>
+    size_t read(Reader &reader, size_t max, F &&fn) {
+        size_t count = 0;
+        while (count < max) {
+            const Segment &seg = *reader.segment;
+            size_t committed = seg.size.load(std::memory_order_acquire);
+            if (reader.pos >= committed) {
+                if (!next_segment(reader)) break;
+                continue;
+            }
+            uint32_t size;
+            std::memcpy(&size, seg.map + reader.pos + 4, sizeof(size));
+            fn(reader.next, std::string_view(seg.map + reader.pos + LOG_HEADER_SIZE, size));
+            reader.pos += LOG_HEADER_SIZE + size;
+            reader.next++;
+            count++;
+        }
+        return count;
+    }
+
+    // Runs fn() with appends blocked if the reader has consumed everything,
+    // so a subscriber can switch from replay to live delivery without a gap
+    // or a duplicate.
+    template <typename F>
+    bool if_caught_up(const Reader &reader, F &&fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (reader.next < end) return false;
+        fn(end);
+        return true;
+    }
+
+private:
+    struct IndexEntry {
+        uint64_t offset;
+        uint64_t pos;
+    };
+
+    struct Segment {
+        uint64_t base = 0;
+        int fd = -1;
+        int index_fd = -1;
+        char *map = nullptr;
+        size_t capacity = 0;
+        std::atomic<size_t> size{0};
+        uint64_t next_offset = 0;
+        std::vector<IndexEntry> index;
+
+        // Unmapped only once the log and every reader have let go of it.
+        ~Segment() {
+            if (map) {
+                msync(map, size.load(), MS_SYNC);
+                munmap(map, capacity);
+            }
+            if (fd >= 0) ::close(fd);
+            if (index_fd >= 0) ::close(index_fd);
+        }
+    };
+
+    std::string segment_path(uint64_t base, const char *ext) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu%s", (unsigned long long)base, ext);
+        return dir + "/" + name;
+    }
+
+    // Maps the segment starting at base, creating it with the given
+    // capacity if it does not exist yet. Existing segments are scanned from
+    // their last index entry to find where valid records end.
+    std::shared_ptr<Segment> open_segment(uint64_t base, size_t capacity) {
+        auto seg = std::make_shared<Segment>();
+        seg->base = base;
+        seg->next_offset = base;
+
+        std::string log_path = segment_path(base, ".log");
+        seg->fd = ::open(log_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (seg->fd < 0) {
+            perror("open segment");
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(seg->fd, &st) < 0) {
+            perror("fstat");
+            return nullptr;
+        }
+        seg->capacity = std::max((size_t)st.st_size, capacity);
+        if ((size_t)st.st_size < seg->capacity && ftruncate(seg->fd, (off_t)seg->capacity) < 0) {
+            perror("ftruncate");
+            return nullptr;
+        }
+        void *map = mmap(nullptr, seg->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return nullptr;
+        }
+        seg->map = static_cast<char *>(map);
+
+        std::string index_path = segment_path(base, ".idx");
+        seg->index_fd = ::open(index_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (seg->index_fd < 0) {
+            perror("open index");
+            return nullptr;
+        }
+        IndexEntry entry;
+        while (::read(seg->index_fd, &entry, sizeof(entry)) == (ssize_t)sizeof(entry)) {
+            seg->index.push_back(entry);
+        }
+
+        recover(*seg);
+        return seg;
+    }
+
+    void recover(Segment &seg) {
+        size_t pos = 0;
+        uint64_t offset = seg.base;
+        if (!seg.index.empty()) {
+            pos = seg.index.back().pos;
+            offset = seg.index.back().offset;
+        }
+        while (pos + LOG_HEADER_SIZE <= seg.capacity) {
+            uint32_t header[4];
+            std::memcpy(header, seg.map + pos, LOG_HEADER_SIZE);
+            uint64_t rec_offset;
+            std::memcpy(&rec_offset, &header[2], sizeof(rec_offset));
+            if (header[0] != LOG_RECORD_MAGIC || rec_offset != offset) break;
+            if (pos + LOG_HEADER_SIZE + header[1] > seg.capacity) break;
+            pos += LOG_HEADER_SIZE + header[1];
+            offset++;
+        }
+
+        // Index entries can only point past the end if the data they
+        // describe never reached the file.
+        while (!seg.index.empty() && seg.index.back().pos >= pos) seg.index.pop_back();
+        if (ftruncate(seg.index_fd, (off_t)(seg.index.size() * sizeof(IndexEntry))) < 0) perror("ftruncate index");
+
+        seg.size.store(pos, std::memory_order_release);
+        seg.next_offset = offset;
+    }
+
+    void skip_to(Reader &reader, uint64_t offset) {
+        const Segment &seg = *reader.segment;
+        size_t committed = seg.size.load(std::memory_order_acquire);
+        while (reader.pos < committed) {
+            uint32_t size;
+            uint64_t rec_offset;
+            std::memcpy(&size, seg.map + reader.pos + 4, sizeof(size));
+            std::memcpy(&rec_offset, seg.map + reader.pos + 8, sizeof(rec_offset));
+            if (rec_offset >= offset) break;
+            reader.pos += LOG_HEADER_SIZE + size;
+        }
+    }
+
+    bool next_segment(Reader &reader) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = std::find(segments.begin(), segments.end(), reader.segment);
+        if (it == segments.end() || it + 1 == segments.end()) return false;
+        // The current segment may have been sealed after the caller looked.
+        if (reader.pos < reader.segment->size.load(std::memory_order_acquire)) return true;
+        reader.segment = *(it + 1);
+        reader.pos = 0;
+        return true;
+    }
+
+    std::string dir;
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Segment>> segments;
+    uint64_t end = 0;
+};
+
+using TopicLogPtr = std::shared_ptr<TopicLog>;
+
+// Longest directory name a topic log gets, well below NAME_MAX.
+constexpr size_t LOG_DIR_NAME_MAX = 200;
+
+// The per-topic logs of a broker, all under one directory. Topic names are
+// escaped into a single path component; one too long for that keeps a
+// prefix of it plus a hash of the whole name, and the name itself in a
+// "topic" file next to the segments.
+class MessageLog {
+public:
+    bool open(const std::string &path) {
+        if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror("mkdir");
+            return false;
+        }
+        dir = path;
+        return true;
+    }
+
+    bool enabled() const { return !dir.empty(); }
+
+    // Returns null if the topic's log cannot be opened; that is remembered,
+    // not retried.
+    TopicLogPtr topic(std::string_view name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = logs.find(name);
+        if (it != logs.end()) return it->second;
+
+        std::string file = escape(name);
+        std::string path = dir + "/" + file;
+        auto log = std::make_shared<TopicLog>();
+        if (file.size() > LOG_DIR_NAME_MAX) {
+            file = file.substr(0, LOG_DIR_NAME_MAX - 17) + "~" + hash_name(name);
+            path = dir + "/" + file;
+            if (!claim(path, name)) log = nullptr;
+        }
+        if (log && !log->open(path)) log = nullptr;
+        if (!log) fprintf(stderr, "Cannot log topic '%.*s'\n", (int)name.size(), name.data());
+        logs.emplace(std::string(name), log);
+        return log;
+    }
+
+private:
+    // FNV-1a, as 16 hex digits; stable across runs, unlike std::hash.
+    static std::string hash_name(std::string_view name) {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char ch : name) {
+            hash ^= ch;
+            hash *= 1099511628211ull;
+        }
+        char out[17];
+        snprintf(out, sizeof(out), "%016llx", (unsigned long long)hash);
+        return out;
+    }
+
+    // Records name in the "topic" file of the hashed directory path, or
+    // checks it against the one already there: another name with the same
+    // prefix and hash does not get to share the log.
+    static bool claim(const std::string &path, std::string_view name) {
+        if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror("mkdir");
+            return false;
+        }
+        std::string file = path + "/topic";
+        int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("open topic");
+            return false;
+        }
+        std::string stored;
+        char buf[4096];
+        ssize_t n;
+        while ((n = ::read(fd, buf, sizeof(buf))) > 0) stored.append(buf, (size_t)n);
+        bool ok = stored == name;
+        if (stored.empty()) ok = write(fd, name.data(), name.size()) == (ssize_t)name.size();
+        ::close(fd);
+        return ok;
+    }
+
+    static std::string escape(std::string_view name) {
+        static const char *hex = "0123456789abcdef";
+        std::string out;
+        for (unsigned char ch : name) {
+            if (std::isalnum(ch) || ch == '-' || ch == '_' || ch == '.') {
+                out.push_back((char)ch);
+            } else {
+                out.push_back('%');
+                out.push_back(hex[ch >> 4]);
+                out.push_back(hex[ch & 15]);
+            }
+        }
+        if (out == "." || out == "..") out = "%2e" + out.substr(1);
+        return out;
+    }
+
+    std::string dir;
+    std::mutex mutex;
+    std::map<std::string, TopicLogPtr, std::less<>> logs;
+};
+
+#endif // MESSAGE_LOG_H
@@ -0,0 +1,268 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Per-topic and per-connection counters behind STATS and the Prometheus
+// admin endpoint.
+//
+// Each counter has a single writer, the shard that owns the topic or the
+// connection, so it is bumped with a relaxed load and store rather than a
+// locked read-modify-write and its cache line stays on that core until
+// somebody reads it. STATS has every shard report its own counters; the
+// admin thread reads them from outside, loading them relaxed: a dump is
+// not one instant's snapshot, but every value in it is one the counter
+// really had.
+class Counter {
+public:
+    void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void set(uint64_t v) { value.store(v, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Durations in power-of-two buckets: bucket i counts samples below
+// upper_bound_ns(i); the last bucket is everything slower.
+class TimeHistogram {
+public:
+    static constexpr int MIN_SHIFT = 10;
+    static constexpr int BUCKETS = 21;
+
+    static uint64_t upper_bound_ns(int i) { return uint64_t(1) << (MIN_SHIFT + i); }
+
+    void record(uint64_t ns) {
+        int i = 0;
+        while (i < BUCKETS && ns >= upper_bound_ns(i)) i++;
+        buckets[i].add();
+        total.add();
+        sum.add(ns);
+    }
+
+    uint64_t bucket(int i) const { return buckets[i].get(); }
+    uint64_t count() const { return total.get(); }
+    uint64_t sum_ns() const { return sum.get(); }
+
+    // Upper bound of the bucket holding the percentile; 0 without samples.
+    uint64_t percentile_ns(double p) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * n + 0.5);
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += bucket(i);
+            if (seen >= rank) return upper_bound_ns(i);
+        }
+        return upper_bound_ns(BUCKETS);
+    }
+
+private:
+    Counter buckets[BUCKETS + 1];
+    Counter total;
+    Counter sum;
+};
+
+struct TopicStats {
+    explicit TopicStats(std::string_view topic) : name(topic) {}
+
+    const std::string name;
+    Counter messages_in;
+    Counter bytes_in;
+    // One per subscriber reached, counted at the fan-out.
+    Counter messages_out;
+    Counter bytes_out;
+    // Subscribers the last publish reached.
+    Counter subscribers;
+    // Counted by the subscribers' shards, so a real atomic add.
+    std::atomic<uint64_t> drops{0};
+    // Time the owner spent fanning one message out.
+    TimeHistogram fanout;
+};
+
+struct ConnectionStats {
+    ConnectionStats(int fd, int shard) : fd(fd), shard(shard) {}
+
+    const int fd;
+    const int shard;
+    // Commands, frames and MPUBLISH lines received.
+    Counter messages_in;
+    Counter bytes_in;
+    // Published messages queued for it.
+    Counter messages_out;
+    // Bytes written to the socket, replies included.
+    Counter bytes_out;
+    Counter queue_depth;
+    Counter drops;
+    // Queued messages replaced by a newer one of a conflated topic.
+    Counter conflated;
+    // At-least-once messages sent again for want of an ACK.
+    Counter redelivered;
+};
+
+// What one shard exposes to readers. The lists change only when a topic
+// is first published to or a connection comes or goes, under the mutex;
+// the counters themselves are read without it.
+class ShardMetrics {
+public:
+    // Owner only. The lookup is private to the owner, so finding an
+    // existing topic takes no lock.
+    TopicStats &topic(std::string_view name) {
+        auto it = by_name.find(name);
+        if (it != by_name.end()) return *it->second;
+
+        TopicStats *stats;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats = &topics.emplace_back(name);
+        }
+        by_name.emplace(stats->name, stats);
+        return *stats;
+    }
+
+    void add_connection(std::shared_ptr<ConnectionStats> stats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int fd = stats->fd;
+        connections[fd] = std::move(stats);
+    }
+
+    void remove_connection(int fd) {
+        std::lock_guard<std::mutex> lock(mutex);
+        connections.erase(fd);
+    }
+
+    template <typename F>
+    void for_each_topic(F &&fn) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const TopicStats &stats : topics) fn(stats);
+    }
+
+    template <typename F>
+    void for_each_connection(F &&fn) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &kv : connections) fn(*kv.second);
+    }
+
+private:
+    mutable std::mutex mutex;
+    // Never shrinks; a deque keeps every element in place as it grows.
+    std::deque<TopicStats> topics;
+    std::map<int, std::shared_ptr<ConnectionStats>> connections;
+    // Keys view the names inside topics.
+    std::unordered_map<std::string_view, TopicStats *> by_name;
+};
+
+// Label value for the text exposition format.
+inline std::string prometheus_label(std::string_view value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+inline std::string prometheus_seconds(uint64_t ns) {
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "%.9g", ns * 1e-9);
+    return std::string(buf, n > 0 ? (size_t)n : 0);
+}
+
+// Every shard's counters in the Prometheus text exposition format.
+inline std::string render_prometheus(const std::vector<const ShardMetrics *> &shards) {
+    std::string out;
+    auto family = [&](const char *name, const char *type, const char *help) {
+        out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    };
+    auto sample = [&](const char *name, const std::string &labels, uint64_t value) {
+        out += std::string(name) + "{" + labels + "} " + std::to_string(value) + "\n";
+    };
+
+    struct TopicCounter {
+        const char *name, *type, *help;
+        uint64_t (*get)(const TopicStats &);
+    };
+    static const TopicCounter topic_counters[] = {
+        {"pubsub_topic_messages_in_total", "counter", "Messages published to the topic.",
+         [](const TopicStats &s) { return s.messages_in.get(); }},
+        {"pubsub_topic_bytes_in_total", "counter", "Payload bytes published to the topic.",
+         [](const TopicStats &s) { return s.bytes_in.get(); }},
+        {"pubsub_topic_messages_out_total", "counter", "Deliveries fanned out, one per subscriber reached.",
+         [](const TopicStats &s) { return s.messages_out.get(); }},
+        {"pubsub_topic_bytes_out_total", "counter", "Text-frame bytes fanned out.",
+         [](const TopicStats &s) { return s.bytes_out.get(); }},
+        {"pubsub_topic_subscribers", "gauge", "Subscribers reached by the last publish.",
+         [](const TopicStats &s) { return s.subscribers.get(); }},
+        {"pubsub_topic_drops_total", "counter", "Messages dropped by full subscriber queues.",
+         [](const TopicStats &s) { return s.drops.load(std::memory_order_relaxed); }},
+    };
+    for (const TopicCounter &counter : topic_counters) {
+        family(counter.name, counter.type, counter.help);
+        for (const ShardMetrics *shard : shards) {
+            shard->for_each_topic([&](const TopicStats &s) {
+                sample(counter.name, "topic=\"" + prometheus_label(s.name) + "\"", counter.get(s));
+            });
+        }
+    }
+
+    family("pubsub_topic_fanout_seconds", "histogram", "Time the topic's owner spent fanning one message out.");
+    for (const ShardMetrics *shard : shards) {
+        shard->for_each_topic([&](const TopicStats &s) {
+            std::string topic = "topic=\"" + prometheus_label(s.name) + "\"";
+            uint64_t cumulative = 0;
+            for (int i = 0; i <= TimeHistogram::BUCKETS; i++) {
+                cumulative += s.fanout.bucket(i);
+                std::string le = i < TimeHistogram::BUCKETS ? prometheus_seconds(TimeHistogram::upper_bound_ns(i)) : "+Inf";
+                out += "pubsub_topic_fanout_seconds_bucket{" + topic + ",le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+            }
+            out += "pubsub_topic_fanout_seconds_sum{" + topic + "} " + prometheus_seconds(s.fanout.sum_ns()) + "\n";
+            out += "pubsub_topic_fanout_seconds_count{" + topic + "} " + std::to_string(s.fanout.count()) + "\n";
+        });
+    }
+
+    struct ConnectionCounter {
+        const char *name, *type, *help;
+        uint64_t (*get)(const ConnectionStats &);
+    };
+    static const ConnectionCounter connection_counters[] = {
+        {"pubsub_connection_messages_in_total", "counter", "Commands, frames and batch lines received.",
+         [](const ConnectionStats &s) { return s.messages_in.get(); }},
+        {"pubsub_connection_bytes_in_total", "counter", "Bytes read from the connection.",
+         [](const ConnectionStats &s) { return s.bytes_in.get(); }},
+        {"pubsub_connection_messages_out_total", "counter", "Published messages queued for the connection.",
+         [](const ConnectionStats &s) { return s.messages_out.get(); }},
+        {"pubsub_connection_bytes_out_total", "counter", "Bytes written to the connection.",
+         [](const ConnectionStats &s) { return s.bytes_out.get(); }},
+        {"pubsub_connection_queue_depth", "gauge", "Published messages queued, or unacknowledged at QoS 1.",
+         [](const ConnectionStats &s) { return s.queue_depth.get(); }},
+        {"pubsub_connection_drops_total", "counter", "Messages dropped by the full outbound queue.",
+         [](const ConnectionStats &s) { return s.drops.get(); }},
+        {"pubsub_connection_conflated_total", "counter", "Queued messages replaced by a newer one of a conflated topic.",
+         [](const ConnectionStats &s) { return s.conflated.get(); }},
+        {"pubsub_connection_redelivered_total", "counter", "At-least-once messages sent again for want of an ACK.",
+         [](const ConnectionStats &s) { return s.redelivered.get(); }},
+    };
+    for (const ConnectionCounter &counter : connection_counters) {
+        family(counter.name, counter.type, counter.help);
+        for (const ShardMetrics *shard : shards) {
+            shard->for_each_connection([&](const ConnectionStats &s) {
+                sample(counter.name, "fd=\"" + std::to_string(s.fd) + "\",shard=\"" + std::to_string(s.shard) + "\"",
+                       counter.get(s));
+            });
+        }
+    }
+    return out;
+}
+
+#endif // METRICS_H
@@ -0,0 +1,192 @@
+#ifndef OUTBOUND_QUEUE_H
+#define OUTBOUND_QUEUE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <sys/uio.h>
+
+#include "payload.h"
+
+// What to do when a subscriber's queue is full and another message arrives.
+enum class OverflowPolicy { Unset, DropOldest, DropNewest, Disconnect };
+
+inline const char *overflow_policy_name(OverflowPolicy policy) {
+    switch (policy) {
+    case OverflowPolicy::DropOldest: return "drop-oldest";
+    case OverflowPolicy::DropNewest: return "drop-newest";
+    case OverflowPolicy::Disconnect: return "disconnect";
+    default: return "unset";
+    }
+}
+
+inline bool parse_overflow_policy(std::string_view name, OverflowPolicy &policy) {
+    if (name == "drop-oldest") policy = OverflowPolicy::DropOldest;
+    else if (name == "drop-newest") policy = OverflowPolicy::DropNewest;
+    else if (name == "disconnect") policy = OverflowPolicy::Disconnect;
+    else return false;
+    return true;
+}
+
+// Bounded FIFO of outgoing frames for one connection, drained with writev
+// or by writes submitted to io_uring.
+// Frames are shared PayloadRefs, so queuing one never copies its bytes.
+//
+// Only published messages count against the limit and can be dropped;
+// replies to the connection's own commands are always kept. Not
+// thread-safe: only the shard that owns the connection touches it.
+//
+// A message pushed under a conflation key (its topic id) replaces the one
+// still waiting under the same key, in that one's place in the queue, so a
+// slow reader of a fast topic gets the newest value instead of every stale
+// one in between. The waiting frame is kept aside until drain reaches its
+// slot; from then on it may be on the wire and is left alone.
+class OutboundQueue {
+public:
+    enum class PushResult { Queued, Replaced, DroppedOldest, DroppedNewest, Overflow };
+
+    static constexpr int MAX_IOV = 64;
+
+    PushResult push_message(PayloadRef frame, size_t limit, OverflowPolicy policy, uint32_t key = 0) {
+        if (key != 0) {
+            auto it = pending.find(key);
+            if (it != pending.end()) {
+                it->second = std::move(frame);
+                replaced++;
+                return PushResult::Replaced;
+            }
+        }
+
+        if (messages < limit) {
+            append(std::move(frame), key);
+            messages++;
+            return PushResult::Queued;
+        }
+
+        if (policy == OverflowPolicy::Disconnect) {
+            drops++;
+            return PushResult::Overflow;
+        }
+
+        if (policy == OverflowPolicy::DropOldest) {
+            // Never drop the frame at the head once part of it is on the
+            // wire, or the peer would see half a line, nor one a write in
+            // flight is reading.
+            size_t i = std::max(in_flight, head_offset > 0 ? (size_t)1 : (size_t)0);
+            while (i < items.size() && !items[i].message) i++;
+            if (i < items.size()) {
+                if (!items[i].data) pending.erase(items[i].key);
+                items.erase(items.begin() + i);
+                append(std::move(frame), key);
+                drops++;
+                return PushResult::DroppedOldest;
+            }
+        }
+
+        drops++;
+        return PushResult::DroppedNewest;
+    }
+
+    void push_reply(PayloadRef line) {
+        items.push_back({std::move(line), false, 0});
+    }
+
+    // Writes queued frames until the socket would block. Returns false on
+    // a hard socket error.
+    bool drain(int fd) {
+        while (!items.empty()) {
+            iovec iov[MAX_IOV];
+            int count = gather(iov, MAX_IOV);
+            ssize_t n = writev(fd, iov, count);
+            if (n < 0) {
+                in_flight = 0;
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            sent((size_t)n);
+        }
+        return true;
+    }
+
+    // Points iov at up to max frames from the head, for a write that may
+    // complete later; until sent() says how much of it went out, those
+    // frames stay put. Returns the number of entries.
+    int gather(iovec *iov, int max) {
+        int count = 0;
+        for (size_t i = 0; i < items.size() && count < max; i++, count++) {
+            Item &item = items[i];
+            if (!item.data) {
+                auto it = pending.find(item.key);
+                item.data = std::move(it->second);
+                pending.erase(it);
+            }
+            size_t skip = i == 0 ? head_offset : 0;
+            iov[count].iov_base = const_cast<char *>(item.data.data() + skip);
+            iov[count].iov_len = item.data.size() - skip;
+        }
+        in_flight = (size_t)count;
+        return count;
+    }
+
+    // The write of the gathered frames is done; n bytes of them went out.
+    void sent(size_t n) {
+        in_flight = 0;
+        written += (uint64_t)n;
+        consume(n);
+    }
+
+    bool empty() const { return items.empty(); }
+    size_t size() const { return items.size(); }
+    size_t message_count() const { return messages; }
+    uint64_t dropped() const { return drops; }
+    uint64_t conflated() const { return replaced; }
+    uint64_t written_bytes() const { return written; }
+
+private:
+    struct Item {
+        // Empty while the frame of a conflated message waits in pending.
+        PayloadRef data;
+        bool message;
+        uint32_t key;
+    };
+
+    void append(PayloadRef frame, uint32_t key) {
+        if (key == 0) {
+            items.push_back({std::move(frame), true, 0});
+            return;
+        }
+        items.push_back({PayloadRef(), true, key});
+        pending.emplace(key, std::move(frame));
+    }
+
+    void consume(size_t n) {
+        while (n > 0 && !items.empty()) {
+            size_t left = items.front().data.size() - head_offset;
+            if (n < left) {
+                head_offset += n;
+                return;
+            }
+            n -= left;
+            if (items.front().message) messages--;
+            items.pop_front();
+            head_offset = 0;
+        }
+    }
+
+    std::deque<Item> items;
+    // Conflation key -> newest frame of the message waiting under it.
+    std::unordered_map<uint32_t, PayloadRef> pending;
+    size_t head_offset = 0;
+    // Frames at the head a write in flight points at.
+    size_t in_flight = 0;
+    size_t messages = 0;
+    uint64_t drops = 0;
+    uint64_t replaced = 0;
+    uint64_t written = 0;
+};
+
+#endif // OUTBOUND_QUEUE_H
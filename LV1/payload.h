@@ -0,0 +1,80 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <string_view>
+#include <utility>
+
+// Handle to an immutable, reference-counted byte buffer.
+//
+// A published frame is encoded once and every subscriber queue holds a
+// PayloadRef to the same bytes; the buffer is freed when the last queue
+// has written it out. The count and the bytes live in one allocation, and
+// copying a handle is a single atomic increment, so handles can be passed
+// between reactor threads freely.
+class PayloadRef {
+public:
+    PayloadRef() = default;
+
+    // Encodes the concatenation of parts into a new buffer.
+    static PayloadRef concat(std::initializer_list<std::string_view> parts) {
+        size_t size = 0;
+        for (std::string_view part : parts) size += part.size();
+
+        void *mem = ::operator new(sizeof(Block) + size);
+        Block *block = new (mem) Block(size);
+        char *out = block->bytes();
+        for (std::string_view part : parts) {
+            std::memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+        return PayloadRef(block);
+    }
+
+    PayloadRef(const PayloadRef &other) : block(other.block) {
+        if (block) block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    PayloadRef(PayloadRef &&other) noexcept : block(other.block) {
+        other.block = nullptr;
+    }
+
+    PayloadRef &operator=(PayloadRef other) noexcept {
+        std::swap(block, other.block);
+        return *this;
+    }
+
+    ~PayloadRef() { release(); }
+
+    const char *data() const { return block ? block->bytes() : nullptr; }
+    size_t size() const { return block ? block->size : 0; }
+    std::string_view view() const { return std::string_view(data(), size()); }
+    explicit operator bool() const { return block != nullptr; }
+
+private:
+    struct Block {
+        std::atomic<size_t> refs{1};
+        size_t size;
+
+        explicit Block(size_t n) : size(n) {}
+        char *bytes() { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    explicit PayloadRef(Block *b) : block(b) {}
+
+    void release() {
+        if (block && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            block->~Block();
+            ::operator delete(block);
+        }
+        block = nullptr;
+    }
+
+    Block *block = nullptr;
+};
+
+#endif // PAYLOAD_H
@@ -0,0 +1,448 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Load generator for the LV1 broker. Publishers stamp every message with
+// its send time; subscribers record how long it took to reach them.
+//
+//   ./pubsub_bench --publishers 4 --subscribers 200 --topics 20 --skew 1.1
+//                  --size 128 --rate 5000 --duration 10 --csv runs.csv
+//
+// Each subscriber joins one topic, chosen with a Zipf distribution of the
+// given skew (0 = uniform), so a few topics get most of the fan-out.
+// Publishers spread their messages uniformly over the topics.
+
+constexpr int BUFFER_SIZE = 65536;
+constexpr int MAX_EVENTS = 256;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int publishers = 1;
+    int subscribers = 10;
+    int topics = 1;
+    double skew = 0;
+    size_t size = 64;
+    // Messages per second per publisher; 0 sends as fast as the socket
+    // takes them.
+    double rate = 0;
+    int batch = 1;
+    double duration = 10;
+    double warmup = 1;
+    int sub_threads = 0;
+    std::string csv;
+    std::string hist;
+};
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Latency histogram in the style of HdrHistogram: values below 128 ns are
+// exact, and every power of two above is split into 64 linear buckets, so
+// any recorded value is off by at most 1/64 (~1.6%) with fixed memory.
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BUCKETS = 64;
+    static constexpr int BUCKETS = 58 * SUB_BUCKETS + 2 * SUB_BUCKETS;
+
+    LatencyHistogram() : counts(BUCKETS, 0) {}
+
+    void record(uint64_t ns) {
+        counts[index_of(ns)]++;
+        total++;
+        sum += ns;
+        max_value = std::max(max_value, ns);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < BUCKETS; i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    // Highest value equivalent to the bucket holding the given percentile.
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)std::ceil(p / 100.0 * total);
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(highest_in(i), max_value);
+        }
+        return max_value;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return max_value; }
+    double mean() const { return total ? (double)sum / total : 0; }
+
+private:
+    static int index_of(uint64_t v) {
+        if (v < 2 * SUB_BUCKETS) return (int)v;
+        int shift = 63 - __builtin_clzll(v) - 6;
+        return shift * SUB_BUCKETS + (int)(v >> shift);
+    }
+
+    static uint64_t highest_in(int index) {
+        if (index < 2 * SUB_BUCKETS) return (uint64_t)index;
+        int shift = index / SUB_BUCKETS - 1;
+        uint64_t low = (uint64_t)(index - shift * SUB_BUCKETS) << shift;
+        return low + (1ull << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max_value = 0;
+};
+
+std::atomic<bool> publishing{true};
+std::atomic<bool> receiving{true};
+uint64_t measure_from_ns = 0;
+
+int connect_to(const Options &opt) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(opt.host.c_str(), std::to_string(opt.port).c_str(), &hints, &res) != 0 || !res) {
+        std::cerr << "Cannot resolve " << opt.host << "\n";
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("connect");
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Reads lines until one starts with prefix. Used only during setup.
+bool wait_for_line(int fd, const std::string &prefix) {
+    std::string line;
+    char c;
+    while (read(fd, &c, 1) == 1) {
+        if (c != '\n') {
+            line.push_back(c);
+            continue;
+        }
+        if (line.compare(0, prefix.size(), prefix) == 0) return true;
+        line.clear();
+    }
+    return false;
+}
+
+// Topic rank -> probability mass, for picking subscriber topics.
+std::vector<double> zipf_weights(int n, double skew) {
+    std::vector<double> weights(n);
+    for (int i = 0; i < n; i++) weights[i] = 1.0 / std::pow(i + 1, skew);
+    return weights;
+}
+
+struct PublisherStats {
+    uint64_t sent = 0;
+    std::vector<uint64_t> per_topic;
+};
+
+// One publisher connection. Replies from the broker are drained without
+// blocking between sends so they never back up into its queue.
+void run_publisher(const Options &opt, int id, PublisherStats &stats) {
+    stats.per_topic.assign(opt.topics, 0);
+    int fd = connect_to(opt);
+    if (fd < 0) return;
+
+    std::mt19937_64 rng(0x5eed + id);
+    std::uniform_int_distribution<int> pick(0, opt.topics - 1);
+    std::string padding(opt.size > 21 ? opt.size - 21 : 0, 'x');
+    std::string out;
+    char discard[BUFFER_SIZE];
+
+    double interval_ns = opt.rate > 0 ? 1e9 / opt.rate * opt.batch : 0;
+    uint64_t next_send = now_ns();
+
+    while (publishing.load(std::memory_order_relaxed)) {
+        if (interval_ns > 0) {
+            uint64_t now = now_ns();
+            if (now < next_send) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(next_send - now));
+            }
+            next_send += (uint64_t)interval_ns;
+        }
+
+        out.clear();
+        if (opt.batch > 1) out += "MPUBLISH " + std::to_string(opt.batch) + "\n";
+        for (int i = 0; i < opt.batch; i++) {
+            int topic = pick(rng);
+            // The stamp is zero-padded so every message has the same size.
+            char stamp[24];
+            snprintf(stamp, sizeof(stamp), "%020llu", (unsigned long long)now_ns());
+            if (opt.batch == 1) out += "PUBLISH ";
+            out += "bench/" + std::to_string(topic) + " " + stamp + " " + padding + "\n";
+            stats.per_topic[topic]++;
+        }
+        if (!send_all(fd, out.data(), out.size())) break;
+        stats.sent += opt.batch;
+
+        while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+        }
+    }
+    close(fd);
+}
+
+struct SubscriberThread {
+    std::vector<int> fds;
+    LatencyHistogram latency;
+    // Written only by the owning thread; read by main to see when
+    // deliveries have stopped arriving.
+    std::atomic<uint64_t> received{0};
+};
+
+// Parses "[bench/N] <stamp> ..." lines and records their latency.
+void run_subscribers(SubscriberThread &self) {
+    int epoll_fd = epoll_create1(0);
+    std::vector<std::string> pending(self.fds.empty() ? 0 : *std::max_element(self.fds.begin(), self.fds.end()) + 1);
+    for (int fd : self.fds) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    char buf[BUFFER_SIZE];
+    epoll_event events[MAX_EVENTS];
+    while (receiving.load(std::memory_order_relaxed)) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            ssize_t r = read(fd, buf, sizeof(buf));
+            uint64_t now = now_ns();
+            if (r <= 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                continue;
+            }
+
+            std::string &in = pending[fd];
+            in.append(buf, (size_t)r);
+            size_t start = 0, nl;
+            while ((nl = in.find('\n', start)) != std::string::npos) {
+                size_t close_bracket = in.find("] ", start);
+                if (in[start] == '[' && close_bracket < nl) {
+                    uint64_t sent = std::strtoull(in.c_str() + close_bracket + 2, nullptr, 10);
+                    self.received.store(self.received.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    if (sent >= measure_from_ns && sent <= now) self.latency.record(now - sent);
+                }
+                start = nl + 1;
+            }
+            in.erase(0, start);
+        }
+    }
+    close(epoll_fd);
+}
+
+void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --host H            broker host (127.0.0.1)\n"
+              << "  --port N            broker port (8080)\n"
+              << "  --publishers N      publisher connections (1)\n"
+              << "  --subscribers N     subscriber connections (10)\n"
+              << "  --topics N          topics bench/0 .. bench/N-1 (1)\n"
+              << "  --skew S            Zipf skew of subscribers over topics, 0 = uniform (0)\n"
+              << "  --size N            message payload bytes (64)\n"
+              << "  --rate R            messages/s per publisher, 0 = unthrottled (0)\n"
+              << "  --batch N           messages per MPUBLISH, 1 = plain PUBLISH (1)\n"
+              << "  --duration S        seconds to publish for (10)\n"
+              << "  --warmup S          seconds excluded from the latency figures (1)\n"
+              << "  --sub-threads N     threads reading subscriber sockets (cores, max 4)\n"
+              << "  --csv FILE          append a summary row to FILE\n"
+              << "  --hist FILE         write the latency percentile distribution to FILE\n";
+}
+
+bool parse_options(int argc, char *argv[], Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        const char *value = argv[++i];
+        if (arg == "--host") opt.host = value;
+        else if (arg == "--port") opt.port = std::atoi(value);
+        else if (arg == "--publishers") opt.publishers = std::atoi(value);
+        else if (arg == "--subscribers") opt.subscribers = std::atoi(value);
+        else if (arg == "--topics") opt.topics = std::atoi(value);
+        else if (arg == "--skew") opt.skew = std::atof(value);
+        else if (arg == "--size") opt.size = (size_t)std::atol(value);
+        else if (arg == "--rate") opt.rate = std::atof(value);
+        else if (arg == "--batch") opt.batch = std::atoi(value);
+        else if (arg == "--duration") opt.duration = std::atof(value);
+        else if (arg == "--warmup") opt.warmup = std::atof(value);
+        else if (arg == "--sub-threads") opt.sub_threads = std::atoi(value);
+        else if (arg == "--csv") opt.csv = value;
+        else if (arg == "--hist") opt.hist = value;
+        else return false;
+    }
+    return opt.publishers >= 0 && opt.subscribers >= 0 && opt.topics >= 1 && opt.batch >= 1 && opt.duration > 0;
+}
+
+void write_hist(const std::string &path, const LatencyHistogram &h) {
+    std::ofstream out(path);
+    out << "percentile,latency_us,total_count,one_over_one_minus_percentile\n";
+    for (double p : {0.0, 10.0, 25.0, 50.0, 75.0, 90.0, 95.0, 99.0, 99.5, 99.9, 99.95, 99.99, 99.999, 100.0}) {
+        out << p << "," << h.percentile(p == 0 ? 0.0001 : p) / 1000.0 << "," << (uint64_t)(h.count() * p / 100.0) << ",";
+        if (p < 100) out << 1 / (1 - p / 100);
+        else out << "inf";
+        out << "\n";
+    }
+}
+
+void append_csv(const std::string &path, const Options &opt, double elapsed, uint64_t sent, uint64_t expected,
+                uint64_t received, const LatencyHistogram &h) {
+    bool fresh = !std::ifstream(path).good();
+    std::ofstream out(path, std::ios::app);
+    if (fresh) {
+        out << "publishers,subscribers,topics,skew,size,rate,batch,duration_s,sent,sent_per_s,expected,received,"
+               "received_per_s,lost_pct,mean_us,p50_us,p99_us,p999_us,max_us\n";
+    }
+    double lost = expected ? 100.0 * (double)(expected - std::min(expected, received)) / expected : 0;
+    out << opt.publishers << "," << opt.subscribers << "," << opt.topics << "," << opt.skew << "," << opt.size << ","
+        << opt.rate << "," << opt.batch << "," << elapsed << "," << sent << "," << sent / elapsed << "," << expected
+        << "," << received << "," << received / elapsed << "," << lost << "," << h.mean() / 1000.0 << ","
+        << h.percentile(50) / 1000.0 << "," << h.percentile(99) / 1000.0 << "," << h.percentile(99.9) / 1000.0 << ","
+        << h.max() / 1000.0 << "\n";
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+
+    Options opt;
+    if (!parse_options(argc, argv, opt)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.sub_threads < 1) opt.sub_threads = std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+
+    // Subscribe everyone before the first publish so no message is sent
+    // to a topic whose subscribers are still joining.
+    std::mt19937_64 rng(42);
+    std::vector<double> weights = zipf_weights(opt.topics, opt.skew);
+    std::discrete_distribution<int> pick_topic(weights.begin(), weights.end());
+    std::vector<uint64_t> fanout(opt.topics, 0);
+    std::vector<SubscriberThread> readers(opt.sub_threads);
+
+    for (int i = 0; i < opt.subscribers; i++) {
+        int fd = connect_to(opt);
+        if (fd < 0) return 1;
+        int topic = pick_topic(rng);
+        std::string cmd = "SUBSCRIBE bench/" + std::to_string(topic) + "\n";
+        if (!send_all(fd, cmd.data(), cmd.size()) || !wait_for_line(fd, "Subscribed to")) {
+            std::cerr << "Subscriber " << i << " could not subscribe\n";
+            return 1;
+        }
+        fanout[topic]++;
+        readers[i % opt.sub_threads].fds.push_back(fd);
+    }
+
+    uint64_t start = now_ns();
+    measure_from_ns = start + (uint64_t)(opt.warmup * 1e9);
+
+    std::vector<std::thread> reader_threads;
+    for (auto &r : readers) reader_threads.emplace_back(run_subscribers, std::ref(r));
+
+    std::vector<PublisherStats> pub_stats(opt.publishers);
+    std::vector<std::thread> publisher_threads;
+    for (int i = 0; i < opt.publishers; i++) {
+        publisher_threads.emplace_back(run_publisher, std::cref(opt), i, std::ref(pub_stats[i]));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(opt.duration));
+    publishing = false;
+    for (auto &t : publisher_threads) t.join();
+    double elapsed = (now_ns() - start) / 1e9;
+
+    uint64_t sent = 0, expected = 0;
+    for (const auto &s : pub_stats) {
+        sent += s.sent;
+        for (int t = 0; t < opt.topics && t < (int)s.per_topic.size(); t++) expected += s.per_topic[t] * fanout[t];
+    }
+
+    // Give in-flight deliveries a moment to land.
+    auto received_now = [&] {
+        uint64_t total = 0;
+        for (const auto &r : readers) total += r.received.load(std::memory_order_relaxed);
+        return total;
+    };
+    uint64_t last = received_now();
+    for (int idle = 0; idle < 5 && last < expected;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        uint64_t now = received_now();
+        idle = now == last ? idle + 1 : 0;
+        last = now;
+    }
+    receiving = false;
+    for (auto &t : reader_threads) t.join();
+
+    LatencyHistogram latency;
+    uint64_t received = 0;
+    for (auto &r : readers) {
+        latency.merge(r.latency);
+        received += r.received;
+        for (int fd : r.fds) close(fd);
+    }
+
+    std::cout << "publishers=" << opt.publishers << " subscribers=" << opt.subscribers << " topics=" << opt.topics
+              << " skew=" << opt.skew << " size=" << opt.size << " batch=" << opt.batch << "\n";
+    std::cout << "sent      " << sent << " msgs, " << (uint64_t)(sent / elapsed) << " msgs/s\n";
+    std::cout << "delivered " << received << " of " << expected << " expected, " << (uint64_t)(received / elapsed)
+              << " msgs/s\n";
+    std::cout << "latency (us, " << latency.count() << " samples after warmup)\n";
+    std::cout << "  mean   " << latency.mean() / 1000.0 << "\n";
+    std::cout << "  p50    " << latency.percentile(50) / 1000.0 << "\n";
+    std::cout << "  p99    " << latency.percentile(99) / 1000.0 << "\n";
+    std::cout << "  p99.9  " << latency.percentile(99.9) / 1000.0 << "\n";
+    std::cout << "  max    " << latency.max() / 1000.0 << "\n";
+
+    if (!opt.csv.empty()) append_csv(opt.csv, opt, elapsed, sent, expected, received, latency);
+    if (!opt.hist.empty()) write_hist(opt.hist, latency);
+    return 0;
+}
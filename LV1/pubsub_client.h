@@ -0,0 +1,494 @@
+#ifndef PUBSUB_CLIENT_H
+#define PUBSUB_CLIENT_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "binary_protocol.h"
+#include "line_buffer.h"
+#include "topic_match.h"
+
+struct PubSubMessage {
+    std::string_view topic;
+    std::string_view payload;
+    // Set when the message comes from the topic's log.
+    bool logged = false;
+    uint64_t offset = 0;
+    // The topic's retained last value, sent on subscribing.
+    bool retained = false;
+};
+
+struct PubSubClientOptions {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    // CONFIG QOS 1: the client ACKs every batch of messages once its
+    // handlers have run, and the broker resends what is not acknowledged.
+    bool at_least_once = false;
+    // Publishes queued and not yet written; publish() fails beyond that.
+    size_t max_pending = 65536;
+    std::chrono::milliseconds reconnect_min{100};
+    std::chrono::milliseconds reconnect_max{5000};
+    // Both run on the client thread.
+    std::function<void(bool up)> on_connection;
+    // Text replies of the broker: confirmations, and errors.
+    std::function<void(std::string_view reply)> on_reply;
+    // Messages no subscription matches, such as those of subscriptions
+    // made with command().
+    std::function<void(const PubSubMessage &)> on_unrouted;
+};
+
+// An embeddable broker client. One background thread owns the socket and
+// does all the I/O over the binary protocol; the calls below only queue
+// work for it and never wait for the network, so any thread may make them,
+// handlers included.
+//
+// Publishes queued while the thread is busy go out together, one write of
+// pipelined Publish frames, so a burst costs a syscall rather than one per
+// message. Incoming messages go to the handlers of every matching
+// subscription, on the client thread, in the order they arrive; handlers
+// should not block. When the connection drops the thread reconnects, with
+// exponential backoff, and subscribes again; publishes queued meanwhile go
+// out then. What was already written to a lost connection may be lost with
+// it, and so are messages published while the client was away.
+class PubSubClient {
+public:
+    using Handler = std::function<void(const PubSubMessage &)>;
+    using Clock = std::chrono::steady_clock;
+
+    explicit PubSubClient(PubSubClientOptions options) : options(std::move(options)) {
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        thread = std::thread([this] { run(); });
+    }
+
+    PubSubClient(const PubSubClient &) = delete;
+    PubSubClient &operator=(const PubSubClient &) = delete;
+
+    // Stops the thread and closes the connection; queued publishes are
+    // dropped.
+    ~PubSubClient() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake();
+        thread.join();
+        if (fd >= 0) close(fd);
+        close(wake_fd);
+    }
+
+    // Queues message for topic. False if the topic is not a valid name, the
+    // frame would be too large for the broker, or max_pending publishes are
+    // already queued.
+    bool publish(std::string topic, std::string message) {
+        if (!valid_topic_name(topic) || topic.size() > UINT16_MAX ||
+            2 + topic.size() + message.size() > LineBuffer::MAX_SIZE - FRAME_HEADER_SIZE) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending_publishes >= options.max_pending) return false;
+        pending_publishes++;
+        enqueue({Outgoing::Publish, std::move(topic), std::move(message)});
+        return true;
+    }
+
+    // Calls handler with every message published to a topic filter matches,
+    // from now until unsubscribe(id), across reconnects. Returns the id, or
+    // 0 if filter is not a valid filter.
+    uint64_t subscribe(std::string filter, Handler handler) {
+        if (!valid_topic_filter(filter)) return 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (filter_count(filter) == 0) enqueue({Outgoing::Subscription, {}, "SUBSCRIBE " + filter});
+        uint64_t id = next_id++;
+        subscriptions[id] = {std::move(filter), std::make_shared<const Handler>(std::move(handler))};
+        routes_stale = true;
+        return id;
+    }
+
+    // Messages already received may still reach the handler.
+    void unsubscribe(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = subscriptions.find(id);
+        if (it == subscriptions.end()) return;
+        std::string filter = std::move(it->second.filter);
+        subscriptions.erase(it);
+        if (filter_count(filter) == 0) enqueue({Outgoing::Subscription, {}, "UNSUBSCRIBE " + filter});
+        routes_stale = true;
+    }
+
+    // Sends any other text command; its reply goes to on_reply. Commands
+    // are not repeated after a reconnect.
+    void command(std::string line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        enqueue({Outgoing::Command, {}, std::move(line)});
+    }
+
+    bool connected() const { return up.load(std::memory_order_relaxed); }
+
+private:
+    struct Outgoing {
+        // Subscription commands are dropped while disconnected: subscribing
+        // again on reconnect covers them.
+        enum Kind { Publish, Command, Subscription } kind;
+        std::string topic;
+        std::string body;
+    };
+
+    struct Subscription {
+        std::string filter;
+        std::shared_ptr<const Handler> handler;
+    };
+
+    enum class State { Idle, Connecting, Handshake, Ready };
+
+    // Stop taking from the queue while this much is waiting for the socket.
+    static constexpr size_t OUT_HIGH_WATER = 256 * 1024;
+    static constexpr size_t READ_SIZE = 64 * 1024;
+    // Largest frame payload the broker sends: a message, no larger than it
+    // accepts from a publisher, behind a sequence number and a log offset.
+    static constexpr size_t MAX_PAYLOAD = LineBuffer::MAX_SIZE + 16;
+
+    // Under mutex. Only the first item queued wakes the thread; it takes
+    // everything queued by then.
+    void enqueue(Outgoing item) {
+        bool was_empty = queued.empty();
+        queued.push_back(std::move(item));
+        if (was_empty) wake();
+    }
+
+    void wake() {
+        // EAGAIN means the counter is full, which wakes the thread all the same.
+        uint64_t one = 1;
+        while (write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+    }
+
+    size_t filter_count(const std::string &filter) const {
+        size_t n = 0;
+        for (const auto &[id, sub] : subscriptions) n += sub.filter == filter;
+        return n;
+    }
+
+    void run() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) return;
+            }
+            if (state == State::Idle && Clock::now() >= retry_at) start_connect();
+            if (state == State::Ready) take_queued();
+            if (!out.empty() && (state == State::Handshake || state == State::Ready) && !flush()) {
+                disconnect();
+                continue;
+            }
+
+            pollfd fds[2] = {{wake_fd, POLLIN, 0}, {fd, 0, 0}};
+            if (state == State::Connecting || !out.empty()) fds[1].events |= POLLOUT;
+            if (state == State::Handshake || state == State::Ready) fds[1].events |= POLLIN;
+            int timeout = -1;
+            if (state == State::Idle) {
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(retry_at - Clock::now());
+                timeout = (int)std::max<int64_t>(0, wait.count());
+            }
+            if (poll(fds, state == State::Idle ? 1 : 2, timeout) < 0 && errno != EINTR) return;
+
+            if (fds[0].revents & POLLIN) {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) return;
+            }
+            if (state == State::Idle || fds[1].revents == 0) continue;
+            if (state == State::Connecting) {
+                finish_connect();
+            } else if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && !read_socket()) {
+                disconnect();
+            }
+        }
+    }
+
+    void start_connect() {
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addrs = nullptr;
+        if (getaddrinfo(options.host.c_str(), std::to_string(options.port).c_str(), &hints, &addrs) != 0) {
+            retry_later();
+            return;
+        }
+        fd = socket(addrs->ai_family, addrs->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addrs->ai_protocol);
+        if (fd >= 0 && connect(fd, addrs->ai_addr, addrs->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addrs);
+        if (fd < 0) {
+            retry_later();
+            return;
+        }
+        state = State::Connecting;
+    }
+
+    void finish_connect() {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            disconnect();
+            return;
+        }
+        out = "PROTOCOL BINARY\n";
+        state = State::Handshake;
+    }
+
+    // The broker confirmed the switch: configure the connection, subscribe
+    // to every filter again, then go on with the queue.
+    void ready() {
+        state = State::Ready;
+        backoff = options.reconnect_min;
+        if (options.at_least_once) append_command("CONFIG QOS 1");
+        std::vector<std::string> filters;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::deque<Outgoing> kept;
+            for (Outgoing &item : queued) {
+                if (item.kind != Outgoing::Subscription) kept.push_back(std::move(item));
+            }
+            queued.swap(kept);
+            for (const auto &[id, sub] : subscriptions) filters.push_back(sub.filter);
+        }
+        std::sort(filters.begin(), filters.end());
+        filters.erase(std::unique(filters.begin(), filters.end()), filters.end());
+        for (const std::string &filter : filters) append_command("SUBSCRIBE " + filter);
+        up.store(true, std::memory_order_relaxed);
+        if (options.on_connection) options.on_connection(true);
+    }
+
+    void retry_later() {
+        retry_at = Clock::now() + backoff;
+        backoff = std::min(backoff * 2, options.reconnect_max);
+    }
+
+    void disconnect() {
+        bool was_up = state == State::Ready;
+        if (fd >= 0) close(fd);
+        fd = -1;
+        state = State::Idle;
+        in.clear();
+        out.clear();
+        topic_ids.clear();
+        topic_names.clear();
+        routes.clear();
+        retry_later();
+        if (was_up) {
+            up.store(false, std::memory_order_relaxed);
+            if (options.on_connection) options.on_connection(false);
+        }
+    }
+
+    // Moves what is queued into the output buffer, up to the high water.
+    void take_queued() {
+        std::vector<Outgoing> items;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t budget = out.size() < OUT_HIGH_WATER ? OUT_HIGH_WATER - out.size() : 0;
+            while (!queued.empty() && budget > 0) {
+                Outgoing &item = queued.front();
+                budget -= std::min(budget, item.topic.size() + item.body.size() + FRAME_HEADER_SIZE + 2);
+                if (item.kind == Outgoing::Publish) pending_publishes--;
+                items.push_back(std::move(item));
+                queued.pop_front();
+            }
+        }
+        for (const Outgoing &item : items) {
+            if (item.kind != Outgoing::Publish) append_command(item.body);
+            else append_publish(item.topic, item.body);
+        }
+    }
+
+    void append_frame(Opcode opcode, uint32_t topic_id, std::string_view head, std::string_view body = {}) {
+        char header[FRAME_HEADER_SIZE];
+        encode_frame_header(header, {opcode, 0, topic_id, (uint32_t)(head.size() + body.size())});
+        out.append(header, sizeof(header));
+        out.append(head);
+        out.append(body);
+    }
+
+    void append_command(std::string_view line) { append_frame(Opcode::Command, 0, line); }
+
+    // By id once the broker has announced one for the topic.
+    void append_publish(const std::string &topic, std::string_view message) {
+        auto it = topic_ids.find(topic);
+        if (it != topic_ids.end()) {
+            append_frame(Opcode::Publish, it->second, message);
+            return;
+        }
+        char len[2];
+        put_u16(len, (uint16_t)topic.size());
+        append_frame(Opcode::Publish, 0, std::string(len, sizeof(len)) + topic, message);
+    }
+
+    // Writes until the socket would block. False on a hard error.
+    bool flush() {
+        size_t done = 0;
+        while (done < out.size()) {
+            ssize_t n = send(fd, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0) return false;
+            done += (size_t)n;
+        }
+        out.erase(0, done);
+        return true;
+    }
+
+    // Reads what is there, up to one frame of the largest size at a time,
+    // and handles every complete frame. False once the connection is gone
+    // or the broker broke the protocol, a frame over MAX_PAYLOAD included.
+    bool read_socket() {
+        char buf[READ_SIZE];
+        bool open = true;
+        while (open && in.size() < FRAME_HEADER_SIZE + MAX_PAYLOAD) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n > 0) in.append(buf, (size_t)n);
+            else open = false;
+        }
+
+        size_t pos = 0;
+        if (state == State::Handshake) {
+            // The confirmation is the last text line; frames follow it.
+            size_t end = in.find('\n');
+            if (end == std::string::npos) return open && in.size() < LineBuffer::MAX_SIZE;
+            if (std::string_view(in).substr(0, end) != "Switched to binary protocol") return false;
+            pos = end + 1;
+            ready();
+        }
+
+        refresh_routes();
+        uint64_t acked = 0;
+        while (in.size() - pos >= FRAME_HEADER_SIZE) {
+            FrameHeader header = decode_frame_header(in.data() + pos);
+            if (header.length > MAX_PAYLOAD) return false;
+            if (in.size() - pos - FRAME_HEADER_SIZE < header.length) break;
+            std::string_view payload = std::string_view(in).substr(pos + FRAME_HEADER_SIZE, header.length);
+            pos += FRAME_HEADER_SIZE + header.length;
+            if (!handle_frame(header, payload, acked)) return false;
+        }
+        in.erase(0, pos);
+        if (acked > 0) append_command("ACK " + std::to_string(acked));
+        return open;
+    }
+
+    // acked is raised to the sequence number of an at-least-once message.
+    bool handle_frame(const FrameHeader &header, std::string_view payload, uint64_t &acked) {
+        switch (header.opcode) {
+        case Opcode::Topic:
+            topic_ids[std::string(payload)] = header.topic_id;
+            topic_names[header.topic_id] = std::string(payload);
+            routes.erase(header.topic_id);
+            return true;
+        case Opcode::Reply:
+            if (options.on_reply) options.on_reply(payload);
+            return true;
+        case Opcode::Ack:
+            return true;
+        case Opcode::Message:
+            break;
+        default:
+            return false;
+        }
+
+        if ((header.flags & FLAG_SEQUENCED) != 0) {
+            if (payload.size() < 8) return false;
+            acked = std::max(acked, get_u64(payload.data()));
+            payload.remove_prefix(8);
+        }
+        PubSubMessage message;
+        if ((header.flags & FLAG_LOGGED) != 0) {
+            if (payload.size() < 8) return false;
+            message.logged = true;
+            message.offset = get_u64(payload.data());
+            payload.remove_prefix(8);
+        }
+        message.retained = (header.flags & FLAG_RETAINED) != 0;
+        message.payload = payload;
+
+        auto name = topic_names.find(header.topic_id);
+        if (name == topic_names.end()) return false;
+        message.topic = name->second;
+        const auto &handlers = route(header.topic_id, name->second);
+        for (const auto &handler : handlers) (*handler)(message);
+        if (handlers.empty() && options.on_unrouted) options.on_unrouted(message);
+        return true;
+    }
+
+    // The handlers for a topic id, looked up once per topic and kept until
+    // the subscriptions change.
+    const std::vector<std::shared_ptr<const Handler>> &route(uint32_t topic_id, const std::string &topic) {
+        auto it = routes.find(topic_id);
+        if (it != routes.end()) return it->second;
+        std::vector<std::shared_ptr<const Handler>> handlers;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto &[id, sub] : subscriptions) {
+                if (topic_matches(sub.filter, topic)) handlers.push_back(sub.handler);
+            }
+        }
+        return routes.emplace(topic_id, std::move(handlers)).first->second;
+    }
+
+    void refresh_routes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!routes_stale) return;
+        routes_stale = false;
+        routes.clear();
+    }
+
+    const PubSubClientOptions options;
+
+    // Shared with the calling threads, under mutex.
+    std::mutex mutex;
+    std::deque<Outgoing> queued;
+    size_t pending_publishes = 0;
+    std::map<uint64_t, Subscription> subscriptions;
+    uint64_t next_id = 1;
+    bool routes_stale = false;
+    bool stopping = false;
+
+    int wake_fd = -1;
+    std::atomic<bool> up{false};
+
+    // The client thread's own.
+    int fd = -1;
+    State state = State::Idle;
+    Clock::time_point retry_at;
+    std::chrono::milliseconds backoff{options.reconnect_min};
+    std::string in;
+    std::string out;
+    std::unordered_map<std::string, uint32_t> topic_ids;
+    std::unordered_map<uint32_t, std::string> topic_names;
+    std::unordered_map<uint32_t, std::vector<std::shared_ptr<const Handler>>> routes;
+
+    std::thread thread;
+};
+
+#endif // PUBSUB_CLIENT_H
@@ -2,254 +2,2512 @@
 #include <string>
 #include <thread>
 #include <vector>
+#include <deque>
 #include <map>
 #include <set>
-#include <mutex>
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <charconv>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "../common/async_logger.h"
+#include "ack_window.h"
+#include "binary_protocol.h"
+#include "content_filter.h"
+#include "line_buffer.h"
+#include "message_log.h"
+#include "metrics.h"
+#include "outbound_queue.h"
+#include "payload.h"
+#include "spsc_queue.h"
+#include "topic_interner.h"
+#include "topic_registry.h"
+#include "uring.h"
+
 constexpr int PORT = 8080;
-constexpr int BUFFER_SIZE = 4096;
+constexpr int MAX_EVENTS = 256;
+constexpr size_t REPLAY_BATCH = 256;
+constexpr size_t INBOX_CAPACITY = 1024;
+constexpr size_t INBOX_BATCH = 1024;
+constexpr uint64_t NO_REPLY = UINT64_MAX;
+constexpr unsigned RING_ENTRIES = 4096;
+constexpr uint16_t RECV_GROUP = 0;
+constexpr unsigned RECV_BUFFERS = 512;
+constexpr unsigned RECV_BUFFER_SIZE = 8192;
+constexpr size_t MAX_ACK_WINDOW = 1 << 20;
+// How often a shard with QoS 1 subscribers looks for ACK timeouts.
+constexpr std::chrono::milliseconds ACK_CHECK_INTERVAL{10};
+
+// Where a SUBSCRIBE ... FROM subscriber is in a topic's log. While
+// replaying, live publishes are skipped (the replay will reach them); once
+// caught up, only offsets from live_from on are delivered live.
+struct LogCursor {
+    TopicLogPtr log;
+    TopicLog::Reader reader;
+    uint32_t topic_id = 0;
+    bool live = false;
+    uint64_t live_from = 0;
+    // The replay may only go live once the topic's owner holds the
+    // subscription, which its answer to this reply slot confirms.
+    uint64_t reply = NO_REPLY;
+    bool registered = false;
+};
+
+// A listing every shard contributes to (LIST TOPICS, STATS). Each shard
+// fills in what it owns, on its own thread; the asking shard merges the
+// parts into the one in its reply slot.
+struct Report {
+    enum Kind { Topics, Stats } kind = Topics;
+    // STATS sections asked for.
+    bool topics = true;
+    bool connections = true;
+    // Topic names for LIST TOPICS; the lines of each section for STATS.
+    std::vector<std::string> topic_lines;
+    std::vector<std::string> connection_lines;
+};
+
+// A reply not sent yet. Commands answered by another shard reserve one, so
+// a client still gets its replies in the order it sent the commands.
+struct PendingReply {
+    // Answers still expected from other shards.
+    size_t waiting = 0;
+    // Protocol of the command that reserved the slot.
+    bool binary = false;
+    // Published messages become frames once this reply is queued.
+    bool to_binary = false;
+    std::vector<PayloadRef> frames;
+    // Set for a report; becomes the frames once the last part is in.
+    std::unique_ptr<Report> report;
+};
+
+struct PeerTarget;
+
+// The write an io_uring shard has in flight for a connection.
+struct RingSend {
+    iovec iov[OutboundQueue::MAX_IOV];
+    msghdr msg{};
+};
+
+// Per-connection state. Only the shard whose reactor accepted the socket
+// reads or writes it; other shards hold a reference (in their registries,
+// and in the answers they send back) but never touch the fields.
+struct Connection {
+    int fd;
+    int shard = 0;
+    std::shared_ptr<ConnectionStats> stats;
+    LineBuffer in;
+    // Filters this connection joined, with its membership on every shard
+    // that holds the filter (indexed by shard, empty until it answered);
+    // teardown visits only these.
+    std::unordered_map<std::string, std::vector<TopicRegistry::Subscription>> topics;
+    // Consumer groups joined, by filter and group name, and conditional
+    // subscriptions, by filter and canonical condition, kept the same way.
+    std::map<std::pair<std::string, std::string>, std::vector<TopicRegistry::Subscription>> groups;
+    std::map<std::pair<std::string, std::string>, std::vector<TopicRegistry::Subscription>> selections;
+    // Lines still expected by an MPUBLISH, and how that batch is going.
+    size_t batch_left = 0;
+    size_t batch_size = 0;
+    size_t batch_rejected = 0;
+
+    OutboundQueue queue;
+    OverflowPolicy policy = OverflowPolicy::Unset;
+    // Overrides the topics' conflation setting once configured.
+    std::optional<bool> conflate;
+    // At-least-once delivery, enabled by CONFIG QOS 1.
+    AckWindow acks;
+    // Already on the reactor's acking list.
+    bool ack_listed = false;
+    std::map<std::string, LogCursor, std::less<>> cursors;
+    // Commands and replies are length-prefixed frames.
+    bool binary = false;
+    // Published messages are frames too; set only once the confirmation of
+    // the switch is queued, so no frame can overtake that last text line.
+    bool binary_messages = false;
+    // Topic ids this binary connection has been told the name of.
+    std::unordered_set<uint32_t> announced;
+    // Replies not sent yet, oldest first; the first has sequence number
+    // reply_base.
+    std::deque<PendingReply> replies;
+    uint64_t reply_base = 0;
+    bool closed = false;
+    // Already on the reactor's replay list.
+    bool replay_scheduled = false;
+
+    // A link to a peer broker. Set before the link subscribes to anything
+    // and never changed after, so other shards may read it.
+    bool peer = false;
+    // The broker this link dialed, if it is the dialing side.
+    PeerTarget *dialed = nullptr;
+    // Id of the broker at the other end.
+    uint64_t peer_id = 0;
+    // Topic names behind the ids the peer announced.
+    std::unordered_map<uint32_t, std::string> peer_topics;
+    // Filters advertised to the peer over this link.
+    std::set<std::string, std::less<>> advertised;
+
+    // io_uring only. Operations in flight on the socket, which stays open
+    // until the last of them completes, so its number cannot be reused.
+    int ring_ops = 0;
+    // A write is in flight, or waits for the pass's batch.
+    bool sending = false;
+    bool send_scheduled = false;
+    std::unique_ptr<RingSend> send;
+};
+
+TopicInterner topic_ids;
+MessageLog message_log;
+size_t queue_limit = 1024;
+// QoS 1 defaults: messages in flight per subscriber, and how long an ACK
+// may take before they are sent again.
+size_t ack_window = 1024;
+std::chrono::milliseconds ack_timeout{1000};
+OverflowPolicy default_policy = OverflowPolicy::DropOldest;
+bool use_uring = false;
+
+bool send_queued(const ConnectionPtr &conn);
+
+// Subscribers reading from the log get every message tagged with its
+// offset so they can resume from there after a reconnect.
+PayloadRef encode_logged(std::string_view topic, uint64_t offset, std::string_view message) {
+    std::string off = std::to_string(offset);
+    return PayloadRef::concat({"[", topic, "@", off, "] ", message, "\n"});
+}
+
+// A binary frame whose payload is head followed by body.
+PayloadRef encode_frame(Opcode opcode, uint8_t flags, uint32_t topic_id, std::string_view head, std::string_view body = {}) {
+    char header[FRAME_HEADER_SIZE];
+    encode_frame_header(header, {opcode, flags, topic_id, (uint32_t)(head.size() + body.size())});
+    return PayloadRef::concat({std::string_view(header, sizeof(header)), head, body});
+}
+
+PayloadRef encode_logged_binary(uint32_t topic_id, uint64_t offset, std::string_view message, uint8_t flags = 0) {
+    char off[8];
+    put_u64(off, offset);
+    return encode_frame(Opcode::Message, FLAG_LOGGED | flags, topic_id, std::string_view(off, sizeof(off)), message);
+}
+
+PayloadRef encode_reply(bool binary, std::string_view line) {
+    return binary ? encode_frame(Opcode::Reply, 0, 0, line) : PayloadRef::concat({line, "\n"});
+}
+
+// Tells a binary connection which topic an id stands for, once, and ahead
+// of anything else that uses the id. Returns false on a write error.
+bool announce_topic(const ConnectionPtr &conn, uint32_t topic_id, std::string_view topic) {
+    if (!conn->announced.insert(topic_id).second) return true;
+    bool was_empty = conn->queue.empty();
+    conn->queue.push_reply(encode_frame(Opcode::Topic, 0, topic_id, topic));
+    return !was_empty || send_queued(conn);
+}
+
+// One PUBLISH on its way from the publisher, through the topic's owner, to
+// the subscribers. Until own() is called, topic and message may point into
+// the publisher's input buffer.
+struct Publication {
+    std::string_view topic;
+    std::string_view message;
+    PayloadRef frame;
+    bool logged = false;
+    uint64_t offset = 0;
+    uint32_t topic_id = 0;
+    // The topic's last value, sent to a new subscriber; only binary frames
+    // say so.
+    bool retained = false;
+    // Came in over a peer link, so it is for local subscribers only.
+    bool from_peer = false;
+    // Set by the owner for the subscribers' shards to count drops in.
+    TopicStats *stats = nullptr;
+    PayloadRef tagged;
+    PayloadRef binary;
+    PayloadRef binary_tagged;
+
+    // Encodes the text frame, once, and points topic and message into it,
+    // so the publication can be handed to another shard.
+    void own() {
+        size_t len = topic.size();
+        if (!frame) frame = PayloadRef::concat({"[", topic, "] ", message, "\n"});
+        std::string_view text = frame.view();
+        topic = text.substr(1, len);
+        message = text.substr(len + 3, text.size() - len - 4);
+    }
+
+    // The frames below are built on first use, only if a subscriber of
+    // that kind needs one.
+    const PayloadRef &tagged_frame() {
+        if (!tagged) tagged = encode_logged(topic, offset, message);
+        return tagged;
+    }
+
+    uint32_t id() {
+        if (topic_id == 0) topic_id = topic_ids.intern(topic);
+        return topic_id;
+    }
+
+    const PayloadRef &binary_frame() {
+        if (!binary) binary = encode_frame(Opcode::Message, retained ? FLAG_RETAINED : 0, id(), message);
+        return binary;
+    }
+
+    const PayloadRef &binary_tagged_frame() {
+        if (!binary_tagged) binary_tagged = encode_logged_binary(id(), offset, message, retained ? FLAG_RETAINED : 0);
+        return binary_tagged;
+    }
+};
+
+// A request to, or an answer from, another shard. Which fields are used
+// depends on the kind.
+struct ShardMessage {
+    enum class Kind {
+        Subscribe,    // conn, filter, group, balance, condition, reply -> Subscribed
+        Unsubscribe,  // conn, filter, group, where, sub, reply         -> Unsubscribed, if reply is set
+        SetPolicy,    // filter, policy
+        SetConflate,  // filter, conflate
+        SetRetain,    // filter, retain
+        Publish,      // conn, pub, ack, reply     -> Published, if reply is set
+        Deliver,      // pub, targets, policy, conflate
+        Subscribed,   // conn, filter, group, where, sub, retained, reply
+        Unsubscribed, // conn, reply
+        Published,    // conn, pub, ack, delivered, reply
+        Interest,     // conn (a peer link), filter
+        Report,       // conn, report, reply   -> Reported
+        Reported,     // conn, report, reply
+    };
+
+    Kind kind = Kind::Deliver;
+    // Shard that sent the message.
+    int from = 0;
+    ConnectionPtr conn;
+    std::string filter;
+    // Consumer group of the filter, if any.
+    std::string group;
+    GroupBalance balance = GroupBalance::Unset;
+    // WHERE condition of the subscription, if any, and its canonical text.
+    ContentFilterPtr condition;
+    std::string where;
+    TopicRegistry::Subscription sub;
+    OverflowPolicy policy = OverflowPolicy::Unset;
+    bool conflate = false;
+    bool retain = false;
+    Publication pub;
+    std::vector<ConnectionPtr> targets;
+    // Retained values of the topics a new subscription matches.
+    std::vector<Publication> retained;
+    // Reply slot on the requesting connection, or NO_REPLY.
+    uint64_t reply = NO_REPLY;
+    // The publish came as a Publish frame and is answered with an Ack.
+    bool ack = false;
+    bool delivered = false;
+    std::unique_ptr<Report> report;
+};
+
+using ShardMessagePtr = std::unique_ptr<ShardMessage>;
+
+// One shard per core: an event loop with its own listening socket, its own
+// connections, and the registry of the topics it owns. Shards share no
+// mutable state; whatever one needs done by another goes into the other's
+// inbox.
+struct Reactor {
+    int id = 0;
+    int epoll_fd = -1; // -1 under io_uring
+    int listen_fd = -1;
+    int wake_fd = -1;
+    TopicRegistry registry;
+    ShardMetrics metrics;
+    // Topics owned here that keep their last value, with it (an empty
+    // frame until the first publish).
+    std::map<std::string, Publication, std::less<>> retained;
+    // Logs of the topics owned here (null for one whose log cannot be
+    // opened), so only a topic's first publish takes the MessageLog lock.
+    std::map<std::string, TopicLogPtr, std::less<>> logs;
+    std::unordered_map<int, ConnectionPtr> connections;
+    std::vector<int> closed_fds;
+    std::vector<ConnectionPtr> replaying;
+    // Connections that turned QoS 1 on, checked for ACK timeouts.
+    std::vector<ConnectionPtr> acking;
+    AckWindow::Clock::time_point next_ack_check;
+
+    // inbox[i] carries the messages from shard i (there is none from the
+    // shard itself). A message that does not fit in shard j's inbox waits
+    // in overflow[j] of the sender until the next pass.
+    std::vector<std::unique_ptr<SpscQueue<ShardMessagePtr>>> inbox;
+    std::vector<std::deque<ShardMessagePtr>> overflow;
+    // Shards sent something during this pass.
+    std::vector<bool> notify;
+    // Set while blocked in epoll_wait; only then do senders write wake_fd.
+    std::atomic<bool> sleeping{false};
+
+    // Sockets the dialer connected to peers, for this shard to take over.
+    std::mutex adopt_mutex;
+    std::vector<std::pair<int, PeerTarget *>> adopted;
+
+    // With --io uring: the shard's ring, created by its own thread, and
+    // the connections to write to in the batch that ends the pass.
+    std::unique_ptr<Uring> ring;
+    std::vector<ConnectionPtr> sending;
+};
+
+std::vector<std::unique_ptr<Reactor>> shards;
+
+// Gets what conn has queued on its way: written right away with epoll;
+// with io_uring, by the batch of writes that ends the shard's pass, or
+// after the write in flight. Returns false on a hard socket error.
+bool send_queued(const ConnectionPtr &conn) {
+    Reactor &reactor = *shards[conn->shard];
+    if (!reactor.ring) return conn->queue.drain(conn->fd);
+    if (!conn->sending && !conn->send_scheduled) {
+        conn->send_scheduled = true;
+        reactor.sending.push_back(conn);
+    }
+    return true;
+}
+
+// A broker to keep a link to (--peer), whether the link dialed to it is
+// up, and the id it answered with last time (0 until it has).
+struct PeerTarget {
+    std::string host;
+    int port = 0;
+    std::atomic<bool> up{false};
+    std::atomic<uint64_t> broker{0};
+};
+
+// Brokers peer over TCP links that carry the binary protocol both ways.
+// Each side advertises the filters its own clients subscribe to, as
+// SUBSCRIBE and UNSUBSCRIBE commands, and the other side subscribes the
+// link to them like any client, so a publish crosses a link once however
+// many subscribers it has behind it. What comes in over a link goes to
+// local subscribers only: messages travel one hop, and the brokers are
+// meant to form a full mesh.
+//
+// Every broker picks a random id at startup and the PEER handshake carries
+// it both ways, so two brokers keep a single link between them even when
+// both name the other with --peer: the one dialed by the smaller id.
+struct Federation {
+    bool enabled = false;
+    uint64_t id = 0;
+    std::deque<PeerTarget> targets;
+
+    std::mutex mutex;
+    // Filters the broker's own clients (not its peers) subscribe to, with
+    // how many of them do, across all shards.
+    std::map<std::string, size_t, std::less<>> interest;
+    // The link to each peer, by its id.
+    std::unordered_map<uint64_t, ConnectionPtr> links;
+};
 
-std::mutex topics_mutex;
-std::map<std::string, std::vector<int>> topics;
-std::map<int, std::set<std::string>> client_topics;
+Federation federation;
 
-void remove_client_from_topic_nolock(const std::string &topic, int client_fd) {
-    auto it = topics.find(topic);
-    if (it == topics.end()) return;
-    auto &vec = it->second;
-    vec.erase(std::remove(vec.begin(), vec.end(), client_fd), vec.end());
+// The shard that owns a topic: it appends the topic's log, keeps its
+// policy and fans out everything published to it.
+int owner_of(std::string_view topic) {
+    return (int)(std::hash<std::string_view>{}(topic) % shards.size());
 }
 
-void cleanup_client(int client_fd) {
-    std::lock_guard<std::mutex> lock(topics_mutex);
-    auto it = client_topics.find(client_fd);
-    if (it != client_topics.end()) {
-        for (const auto &topic : it->second) {
-            remove_client_from_topic_nolock(topic, client_fd);
+// The shards that must hold a subscription to filter: a concrete topic is
+// held by its owner, a wildcard by every shard since it can match topics
+// of any of them.
+size_t holder_count(std::string_view filter) {
+    return valid_topic_name(filter) ? 1 : shards.size();
+}
+
+template <typename F>
+void for_each_holder(std::string_view filter, F &&fn) {
+    if (valid_topic_name(filter)) {
+        fn(owner_of(filter));
+        return;
+    }
+    for (int i = 0; i < (int)shards.size(); i++) fn(i);
+}
+
+void handle_shard_message(Reactor &reactor, ShardMessage &msg);
+
+// Hands msg to shard `to`: run on the spot if that is this shard, queued in
+// its inbox otherwise.
+void post(Reactor &reactor, int to, ShardMessage &&msg) {
+    msg.from = reactor.id;
+    if (to == reactor.id) {
+        handle_shard_message(reactor, msg);
+        return;
+    }
+
+    if (!msg.pub.topic.empty()) msg.pub.own();
+    ShardMessagePtr boxed = std::make_unique<ShardMessage>(std::move(msg));
+    std::deque<ShardMessagePtr> &backlog = reactor.overflow[to];
+    if (!backlog.empty() || !shards[to]->inbox[reactor.id]->push(std::move(boxed))) backlog.push_back(std::move(boxed));
+    reactor.notify[to] = true;
+}
+
+void close_connection(Reactor &reactor, const ConnectionPtr &conn);
+
+// Sends every reply at the front that is no longer waiting on a shard.
+void flush_replies(Reactor &reactor, const ConnectionPtr &conn) {
+    bool was_empty = conn->queue.empty();
+    while (!conn->replies.empty() && conn->replies.front().waiting == 0) {
+        PendingReply &slot = conn->replies.front();
+        for (PayloadRef &frame : slot.frames) conn->queue.push_reply(std::move(frame));
+        if (slot.to_binary) conn->binary_messages = true;
+        conn->replies.pop_front();
+        conn->reply_base++;
+    }
+    if (was_empty && !conn->queue.empty() && !send_queued(conn)) close_connection(reactor, conn);
+}
+
+// Reserves the next reply, to be sent once `waiting` answers from other
+// shards have come in. Returns its sequence number.
+uint64_t reserve_reply(Connection &conn, size_t waiting, PayloadRef frame = {}) {
+    PendingReply slot;
+    slot.waiting = waiting;
+    slot.binary = conn.binary;
+    if (frame) slot.frames.push_back(std::move(frame));
+    conn.replies.push_back(std::move(slot));
+    return conn.reply_base + conn.replies.size() - 1;
+}
+
+// One of the answers a reply was waiting for.
+void complete_reply(Reactor &reactor, const ConnectionPtr &conn, uint64_t seq) {
+    if (conn->closed) return;
+    PendingReply &slot = conn->replies[seq - conn->reply_base];
+    if (--slot.waiting == 0) flush_replies(reactor, conn);
+}
+
+void send_reply(Reactor &reactor, const ConnectionPtr &conn, PayloadRef out, bool to_binary = false) {
+    if (conn->closed) return;
+    if (conn->replies.empty() && !to_binary) {
+        bool was_empty = conn->queue.empty();
+        conn->queue.push_reply(std::move(out));
+        if (was_empty && !send_queued(conn)) close_connection(reactor, conn);
+        return;
+    }
+    reserve_reply(*conn, 0, std::move(out));
+    conn->replies.back().to_binary = to_binary;
+    flush_replies(reactor, conn);
+}
+
+void send_line_to_client(Reactor &reactor, const ConnectionPtr &conn, std::string_view line) {
+    send_reply(reactor, conn, encode_reply(conn->binary, line));
+}
+
+// The connection's memberships of filter, of one of its consumer groups, or
+// under a condition (by its canonical text); null if it has not joined.
+std::vector<TopicRegistry::Subscription> *memberships(Connection &conn, const std::string &filter, const std::string &group,
+                                                      const std::string &where) {
+    if (!group.empty()) {
+        auto it = conn.groups.find({filter, group});
+        return it == conn.groups.end() ? nullptr : &it->second;
+    }
+    if (!where.empty()) {
+        auto it = conn.selections.find({filter, where});
+        return it == conn.selections.end() ? nullptr : &it->second;
+    }
+    auto it = conn.topics.find(filter);
+    return it == conn.topics.end() ? nullptr : &it->second;
+}
+
+// Leaves filter, its consumer group or the subscription under a condition,
+// on every shard holding it. With a reply slot, each of them answers into
+// it.
+void unsubscribe(Reactor &reactor, const ConnectionPtr &conn, const std::string &filter, const std::string &group,
+                 const std::string &where, std::vector<TopicRegistry::Subscription> &subs, uint64_t reply) {
+    for_each_holder(filter, [&](int shard) {
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::Unsubscribe;
+        msg.conn = conn;
+        msg.filter = filter;
+        msg.group = group;
+        msg.where = where;
+        msg.sub = std::move(subs[shard]);
+        msg.reply = reply;
+        post(reactor, shard, std::move(msg));
+    });
+}
+
+// Brings what link advertises for filter in line with the broker's
+// interest. It re-reads the interest rather than trusting the message that
+// asked for it, so changes made on different shards can reach the link in
+// any order.
+void sync_interest(Reactor &reactor, const ConnectionPtr &link, const std::string &filter) {
+    if (link->closed) return;
+    bool wanted;
+    {
+        std::lock_guard<std::mutex> lock(federation.mutex);
+        wanted = federation.interest.count(filter) > 0;
+    }
+    auto it = link->advertised.find(filter);
+    if (wanted == (it != link->advertised.end())) return;
+    if (wanted) link->advertised.insert(filter);
+    else link->advertised.erase(it);
+    std::string command = (wanted ? "SUBSCRIBE " : "UNSUBSCRIBE ") + filter;
+    send_reply(reactor, link, encode_frame(Opcode::Command, 0, 0, command));
+}
+
+// A client joined or left filter. Peers hear of the first join and the
+// last leave, from the shard of each link.
+void note_interest(Reactor &reactor, const Connection &conn, const std::string &filter, bool join) {
+    if (!federation.enabled || conn.peer) return;
+    std::vector<ConnectionPtr> links;
+    {
+        std::lock_guard<std::mutex> lock(federation.mutex);
+        if (join) {
+            if (federation.interest[filter]++ > 0) return;
+        } else {
+            auto it = federation.interest.find(filter);
+            if (it == federation.interest.end() || --it->second > 0) return;
+            federation.interest.erase(it);
         }
-        client_topics.erase(it);
+        for (const auto &kv : federation.links) links.push_back(kv.second);
     }
+    for (const ConnectionPtr &link : links) {
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::Interest;
+        msg.conn = link;
+        msg.filter = filter;
+        post(reactor, link->shard, std::move(msg));
+    }
+}
 
-    for (auto & [topic, vec] : topics) {
-        vec.erase(std::remove(vec.begin(), vec.end(), client_fd), vec.end());
+// Of two links to the same broker, the one to keep.
+bool dialed_by_smaller_id(const Connection &link) {
+    return (link.dialed != nullptr) == (federation.id < link.peer_id);
+}
+
+// A link came up, dialed or accepted, to the broker with id broker: from
+// now on both sides speak binary, and this side advertises everything its
+// clients subscribe to. Returns false, leaving the connection as it was, if
+// it is a link to this broker itself or a second link to that one that is
+// not the one to keep. A link it replaces is shut down, and closes on its
+// own shard.
+bool start_link(Reactor &reactor, const ConnectionPtr &link, uint64_t broker) {
+    std::vector<std::string> filters;
+    {
+        std::lock_guard<std::mutex> lock(federation.mutex);
+        if (broker == federation.id) return false;
+        link->peer_id = broker;
+        ConnectionPtr &slot = federation.links[broker];
+        if (slot) {
+            if (!dialed_by_smaller_id(*link) || dialed_by_smaller_id(*slot)) return false;
+            // Still registered, so its socket is not closed yet.
+            shutdown(slot->fd, SHUT_RDWR);
+            LOG_INFO("Peer link fd=" << slot->fd << " replaced by fd=" << link->fd);
+        }
+        slot = link;
+        link->peer = true;
+        for (const auto &kv : federation.interest) filters.push_back(kv.first);
     }
+    // The accepting side answers the dialer's PEER with its own id, as the
+    // last text line.
+    if (!link->dialed) send_line_to_client(reactor, link, "PEER " + std::to_string(federation.id));
+    link->binary = true;
+    link->binary_messages = true;
+
+    for (const std::string &filter : filters) sync_interest(reactor, link, filter);
+    LOG_INFO("Peer link up: fd=" << link->fd << " (shard " << reactor.id << ")");
+    return true;
 }
 
-void send_line_to_client(int client_fd, const std::string &line) {
-    std::string out = line;
-    if (!out.empty() && out.back() != '\n') out.push_back('\n');
+// The socket's number may be reused from here on; the connection itself is
+// dropped at the end of the pass.
+void release_socket(Reactor &reactor, const Connection &conn) {
+    close(conn.fd);
+    reactor.closed_fds.push_back(conn.fd);
+}
+
+void close_connection(Reactor &reactor, const ConnectionPtr &conn) {
+    if (conn->closed) return;
+    conn->closed = true;
 
-    ssize_t sent = send(client_fd, out.c_str(), (size_t)out.size(), 0);
-    if (sent <= 0) { }
+    for (auto &[filter, subs] : conn->topics) {
+        unsubscribe(reactor, conn, filter, {}, {}, subs, NO_REPLY);
+        note_interest(reactor, *conn, filter, false);
+    }
+    for (auto &[key, subs] : conn->groups) {
+        unsubscribe(reactor, conn, key.first, key.second, {}, subs, NO_REPLY);
+        note_interest(reactor, *conn, key.first, false);
+    }
+    for (auto &[key, subs] : conn->selections) {
+        unsubscribe(reactor, conn, key.first, {}, key.second, subs, NO_REPLY);
+        note_interest(reactor, *conn, key.first, false);
+    }
+    if (conn->peer) {
+        {
+            std::lock_guard<std::mutex> lock(federation.mutex);
+            auto it = federation.links.find(conn->peer_id);
+            if (it != federation.links.end() && it->second == conn) federation.links.erase(it);
+        }
+        if (conn->dialed) conn->dialed->up.store(false);
+        LOG_INFO("Peer link down: fd=" << conn->fd);
+    }
+    conn->topics.clear();
+    conn->groups.clear();
+    conn->selections.clear();
+    conn->cursors.clear();
+    conn->replies.clear();
+
+    if (conn->queue.dropped() > 0) {
+        LOG_INFO("Client " << conn->fd << " closed after dropping " << conn->queue.dropped() << " messages");
+    }
+
+    reactor.metrics.remove_connection(conn->fd);
+    if (reactor.ring) {
+        // Ends the operations in flight; the last of them to complete
+        // closes the socket.
+        shutdown(conn->fd, SHUT_RDWR);
+        if (conn->ring_ops == 0) release_socket(reactor, *conn);
+        return;
+    }
+    if (reactor.epoll_fd >= 0) epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    release_socket(reactor, *conn);
 }
 
-void handle_client(int client_fd) {
-    char buf[BUFFER_SIZE];
-    std::string backlog;
+// Mirrors the outbound queue's state into the connection's counters. At
+// QoS 1 a message counts as queued until it is acknowledged.
+void update_queue_stats(const Connection &conn) {
+    conn.stats->queue_depth.set(conn.queue.message_count() + conn.acks.outstanding());
+    conn.stats->drops.set(conn.queue.dropped() + conn.acks.dropped());
+    conn.stats->conflated.set(conn.queue.conflated());
+    conn.stats->bytes_out.set(conn.queue.written_bytes());
+    conn.stats->redelivered.set(conn.acks.redelivered());
+}
 
-    while (true) {
-        ssize_t r = read(client_fd, buf, sizeof(buf));
-        if (r > 0) {
-            backlog.append(buf, buf + r);
-
-            size_t pos;
-            while ((pos = backlog.find('\n')) != std::string::npos) {
-                std::string line = backlog.substr(0, pos);
-                if (!line.empty() && line.back() == '\r') line.pop_back();
-                backlog.erase(0, pos + 1);
-
-                if (line.empty()) continue;
-
-                std::string cmd;
-                {
-                    size_t p = line.find(' ');
-                    if (p == std::string::npos) cmd = line;
-                    else cmd = line.substr(0, p);
-                }
-
-                if (cmd == "SUBSCRIBE") {
-                    size_t p = line.find(' ');
-                    if (p == std::string::npos) {
-                        send_line_to_client(client_fd, "ERROR: SUBSCRIBE requires a topic");
-                        continue;
-                    }
-                    std::string topic = line.substr(p + 1);
-                    if (topic.empty()) {
-                        send_line_to_client(client_fd, "ERROR: empty topic");
-                        continue;
-                    }
-
-                    {
-                        std::lock_guard<std::mutex> lock(topics_mutex);
-                        auto &vec = topics[topic];
-                        if (std::find(vec.begin(), vec.end(), client_fd) == vec.end())
-                            vec.push_back(client_fd);
-                        client_topics[client_fd].insert(topic);
-                    }
-
-                    send_line_to_client(client_fd, std::string("Subscribed to ") + topic);
-                    std::cout << "Client " << client_fd << " subscribed to '" << topic << "'\n";
-                }
-                else if (cmd == "UNSUBSCRIBE") {
-                    size_t p = line.find(' ');
-                    if (p == std::string::npos) {
-                        send_line_to_client(client_fd, "ERROR: UNSUBSCRIBE requires a topic");
-                        continue;
-                    }
-                    std::string topic = line.substr(p + 1);
-                    if (topic.empty()) {
-                        send_line_to_client(client_fd, "ERROR: empty topic");
-                        continue;
-                    }
-
-                    {
-                        std::lock_guard<std::mutex> lock(topics_mutex);
-                        remove_client_from_topic_nolock(topic, client_fd);
-                        auto it = client_topics.find(client_fd);
-                        if (it != client_topics.end()) it->second.erase(topic);
-                    }
-
-                    send_line_to_client(client_fd, std::string("Unsubscribed from ") + topic);
-                    std::cout << "Client " << client_fd << " unsubscribed from '" << topic << "'\n";
-                }
-                else if (cmd == "PUBLISH") {
-                    size_t p = line.find(' ');
-                    if (p == std::string::npos) {
-                        send_line_to_client(client_fd, "ERROR: PUBLISH requires topic and message");
-                        continue;
-                    }
-                    size_t q = line.find(' ', p + 1);
-                    if (q == std::string::npos) {
-                        send_line_to_client(client_fd, "ERROR: PUBLISH requires topic and message");
-                        continue;
-                    }
-                    std::string topic = line.substr(p + 1, q - (p + 1));
-                    std::string message = line.substr(q + 1);
-                    if (topic.empty()) {
-                        send_line_to_client(client_fd, "ERROR: empty topic");
-                        continue;
-                    }
-
-                    std::string payload = std::string("[") + topic + "] " + message;
-
-                    std::vector<int> dead_clients;
-                    {
-                        std::lock_guard<std::mutex> lock(topics_mutex);
-                        auto it = topics.find(topic);
-                        if (it == topics.end() || it->second.empty()) {
-                            send_line_to_client(client_fd, std::string("Published to '") + topic + "' (no subscribers)");
-                            std::cout << "Client " << client_fd << " published to '" << topic << "' but no subscribers\n";
-                            continue;
-                        }
-
-                        auto &subs = it->second;
-                        for (int subfd : subs) {
-                            if (subfd == client_fd) {
-                            }
-
-                            ssize_t sent = send(subfd, (payload + "\n").c_str(), payload.size() + 1, 0);
-                            if (sent <= 0) {
-                                dead_clients.push_back(subfd);
-                            }
-                        }
-
-                        for (int dead : dead_clients) {
-                            subs.erase(std::remove(subs.begin(), subs.end(), dead), subs.end());
-                            auto itc = client_topics.find(dead);
-                            if (itc != client_topics.end()) itc->second.erase(topic);
-                        }
-                    }
-
-                    send_line_to_client(client_fd, std::string("Published to '") + topic + "'");
-                    std::cout << "Client " << client_fd << " published to '" << topic << "': " << message << "\n";
-                }
-                else if (cmd == "LIST") {
-                    if (line == "LIST TOPICS") {
-                        std::lock_guard<std::mutex> lock(topics_mutex);
-                        if (topics.empty()) {
-                            send_line_to_client(client_fd, "No topics available");
-                        } else {
-                            send_line_to_client(client_fd, "Active topics:");
-                            for (const auto &kv : topics) {
-                                send_line_to_client(client_fd, "- " + kv.first);
-                            }
-                        }
-                    } else {
-                        send_line_to_client(client_fd, "ERROR: unknown LIST command");
-                    }
-                }
-                else {
-                    send_line_to_client(client_fd, "ERROR: unknown command");
-                }
+// A message frame as sent at QoS 1: a text line gets "#<seq> " in front, a
+// binary frame FLAG_SEQUENCED and the sequence number ahead of its payload.
+PayloadRef sequence_frame(const PayloadRef &frame, bool binary, uint64_t seq) {
+    std::string_view bytes = frame.view();
+    if (!binary) return PayloadRef::concat({"#", std::to_string(seq), " ", bytes});
+    FrameHeader header = decode_frame_header(bytes.data());
+    header.flags |= FLAG_SEQUENCED;
+    header.length += 8;
+    char head[FRAME_HEADER_SIZE + 8];
+    encode_frame_header(head, header);
+    put_u64(head + FRAME_HEADER_SIZE, seq);
+    return PayloadRef::concat({std::string_view(head, sizeof(head)), bytes.substr(FRAME_HEADER_SIZE)});
+}
+
+// Queues frame under the next sequence number; it stays in the window until
+// acknowledged. Sequenced frames bypass the queue limit: the window bounds
+// them.
+void send_acked(Connection &conn, const PayloadRef &frame) {
+    PayloadRef sequenced = sequence_frame(frame, conn.binary_messages, conn.acks.next_sequence());
+    conn.acks.sent(sequenced, AckWindow::Clock::now());
+    conn.queue.push_reply(std::move(sequenced));
+    conn.stats->messages_out.add();
+}
+
+// Moves waiting messages into the window as far as it is open.
+void fill_window(Connection &conn) {
+    while (conn.acks.has_waiting() && !conn.acks.full()) send_acked(conn, conn.acks.take_waiting());
+}
+
+// Queues a published frame for a subscriber of this shard. The
+// connection's own policy and conflation setting win over the topic's; the
+// policy falls back to the server default. Log cursors are never conflated,
+// they expect every offset. A QoS 1 subscriber gets the frame sequenced, or
+// once its window opens. A write error or the disconnect policy closes the
+// connection.
+void deliver_message(Reactor &reactor, const ConnectionPtr &conn, Publication &pub, OverflowPolicy topic_policy,
+                     bool topic_conflate) {
+    if (conn->closed) return;
+
+    bool tagged = false;
+    if (pub.logged && !conn->cursors.empty()) {
+        auto it = conn->cursors.find(pub.topic);
+        if (it != conn->cursors.end()) {
+            const LogCursor &cursor = it->second;
+            if (!cursor.live || pub.offset < cursor.live_from) return;
+            tagged = true;
+        }
+    }
+
+    bool was_empty = conn->queue.empty();
+    bool ok = true;
+    const PayloadRef *frame;
+    if (conn->binary_messages) {
+        ok = announce_topic(conn, pub.id(), pub.topic);
+        frame = tagged ? &pub.binary_tagged_frame() : &pub.binary_frame();
+    } else {
+        frame = tagged ? &pub.tagged_frame() : &pub.frame;
+    }
+
+    OverflowPolicy policy = conn->policy;
+    if (policy == OverflowPolicy::Unset) policy = topic_policy;
+    if (policy == OverflowPolicy::Unset) policy = default_policy;
+    bool conflate = !tagged && conn->conflate.value_or(topic_conflate);
+
+    if (ok && conn->acks.enabled()) {
+        // Sequence numbers are contiguous, so nothing is conflated; what the
+        // window has no room for waits, at most queue_limit of it.
+        if (!conn->acks.full()) {
+            send_acked(*conn, *frame);
+        } else if (conn->acks.waiting_count() < queue_limit) {
+            conn->acks.wait(*frame);
+        } else if (policy == OverflowPolicy::Disconnect) {
+            ok = false;
+        } else {
+            if (policy == OverflowPolicy::DropOldest) {
+                conn->acks.drop_oldest_waiting();
+                conn->acks.wait(*frame);
+            } else {
+                conn->acks.drop_newest();
+            }
+            if (pub.stats) pub.stats->drops.fetch_add(1, std::memory_order_relaxed);
+        }
+    } else if (ok) {
+        using PushResult = OutboundQueue::PushResult;
+        PushResult result = conn->queue.push_message(*frame, queue_limit, policy, conflate ? pub.id() : 0);
+        if (result == PushResult::Queued || result == PushResult::DroppedOldest) conn->stats->messages_out.add();
+        bool dropped = result != PushResult::Queued && result != PushResult::Replaced;
+        if (dropped && pub.stats) pub.stats->drops.fetch_add(1, std::memory_order_relaxed);
+        ok = result != PushResult::Overflow;
+    }
+
+    // With data already pending the socket is known to be full; the
+    // EPOLLOUT edge will pick the new frame up.
+    if (ok && was_empty) ok = send_queued(conn);
+    if (!ok) close_connection(reactor, conn);
+    else update_queue_stats(*conn);
+}
+
+// Decimal count or offset; the whole token must be digits.
+bool parse_count(std::string_view s, uint64_t &value) {
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    return !s.empty() && ec == std::errc() && end == s.data() + s.size();
+}
+
+bool parse_switch(std::string_view s, bool &on) {
+    if (s == "on" || s == "ON") on = true;
+    else if (s == "off" || s == "OFF") on = false;
+    else return false;
+    return true;
+}
+
+void schedule_replay(Reactor &reactor, const ConnectionPtr &conn) {
+    if (conn->replay_scheduled) return;
+    conn->replay_scheduled = true;
+    reactor.replaying.push_back(conn);
+}
+
+// Streams the next batch of logged messages to every cursor that is still
+// catching up, never more than the queue has room for. Returns true if
+// there is more to replay and the socket took everything so far, i.e. the
+// reactor should call again without waiting for EPOLLOUT.
+bool pump_replay(Reactor &reactor, const ConnectionPtr &conn) {
+    if (conn->closed) return false;
+
+    bool more = false;
+    for (auto &[topic, cursor] : conn->cursors) {
+        if (cursor.live || !cursor.registered) continue;
+
+        size_t queued = conn->queue.message_count();
+        size_t room = queue_limit > queued ? std::min(queue_limit - queued, REPLAY_BATCH) : 0;
+        if (conn->binary_messages) announce_topic(conn, cursor.topic_id, topic);
+        cursor.log->read(cursor.reader, room, [&](uint64_t offset, std::string_view message) {
+            PayloadRef frame = conn->binary_messages ? encode_logged_binary(cursor.topic_id, offset, message)
+                                                     : encode_logged(topic, offset, message);
+            conn->queue.push_message(std::move(frame), queue_limit, OverflowPolicy::DropNewest);
+            conn->stats->messages_out.add();
+        });
+
+        bool caught_up = cursor.log->if_caught_up(cursor.reader, [&](uint64_t end) {
+            cursor.live = true;
+            cursor.live_from = end;
+        });
+        if (!caught_up) more = true;
+    }
+
+    if (!send_queued(conn)) {
+        close_connection(reactor, conn);
+        return false;
+    }
+    update_queue_stats(*conn);
+    return more && conn->queue.empty();
+}
+
+// Joins filter, its consumer group or its messages that condition holds
+// for, on every shard holding it. The reply goes out once all of them have
+// the subscription, so a client that has seen it can count on the next
+// publish reaching it (or its group).
+void subscribe(Reactor &reactor, const ConnectionPtr &conn, const std::string &filter, std::string_view reply,
+               const std::string &group = {}, GroupBalance balance = GroupBalance::Unset,
+               const ContentFilterPtr &condition = nullptr) {
+    std::vector<TopicRegistry::Subscription> *subs = nullptr;
+    bool first = false;
+    auto join = [&](auto inserted) {
+        subs = &inserted.first->second;
+        first = inserted.second;
+    };
+    if (!group.empty()) join(conn->groups.try_emplace({filter, group}));
+    else if (condition) join(conn->selections.try_emplace({filter, condition->text()}));
+    else join(conn->topics.try_emplace(filter));
+    subs->resize(shards.size());
+    if (first) note_interest(reactor, *conn, filter, true);
+    uint64_t seq = reserve_reply(*conn, holder_count(filter), encode_reply(conn->binary, reply));
+    auto cursor = conn->cursors.find(filter);
+    if (cursor != conn->cursors.end()) cursor->second.reply = seq;
+    for_each_holder(filter, [&](int shard) {
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::Subscribe;
+        msg.conn = conn;
+        msg.filter = filter;
+        msg.group = group;
+        msg.balance = balance;
+        msg.condition = condition;
+        if (condition) msg.where = condition->text();
+        msg.reply = seq;
+        post(reactor, shard, std::move(msg));
+    });
+}
+
+// Splits "<topic> <message>"; the message is everything after the first
+// space, spaces included.
+bool split_topic_message(std::string_view s, std::string_view &topic, std::string_view &message) {
+    size_t p = s.find(' ');
+    if (p == std::string_view::npos) return false;
+    topic = s.substr(0, p);
+    message = s.substr(p + 1);
+    return true;
+}
+
+// One member of a consumer group for the next message: the next in turn,
+// or with least-queued the one with the fewest messages waiting, ties going
+// to the next in turn. Queue depths are read from the members' counters,
+// so one on another shard may be a pass behind.
+const ConnectionPtr &pick_member(const GroupView &group) {
+    const Subscribers &members = *group.members;
+    size_t start = group.state->next.load(std::memory_order_relaxed);
+    size_t pick = start % members.size();
+    if (group.state->balance.load(std::memory_order_relaxed) == GroupBalance::LeastQueued) {
+        uint64_t least = UINT64_MAX;
+        for (size_t i = 0; i < members.size() && least > 0; i++) {
+            size_t k = (start + i) % members.size();
+            uint64_t depth = members[k]->stats->queue_depth.get();
+            if (depth < least) {
+                least = depth;
+                pick = k;
+            }
+        }
+    }
+    group.state->next.store(pick + 1, std::memory_order_relaxed);
+    return members[pick];
+}
+
+// Runs on the topic's owner. Appends the message to the topic's log, if
+// logging is on, and fans it out: straight to the subscribers on this
+// shard, and in one Deliver message to every other shard with subscribers.
+// Every consumer group of a matching filter gets it once, in the member it
+// picks. Returns false if it reached nobody: no subscribers, or none whose
+// WHERE condition holds for the message.
+bool publish(Reactor &reactor, Publication &pub) {
+    TopicStats &stats = reactor.metrics.topic(pub.topic);
+    stats.messages_in.add();
+    stats.bytes_in.add(pub.message.size());
+
+    if (message_log.enabled()) {
+        auto it = reactor.logs.find(pub.topic);
+        if (it == reactor.logs.end()) it = reactor.logs.emplace(pub.topic, message_log.topic(pub.topic)).first;
+        const TopicLogPtr &log = it->second;
+        pub.logged = log && log->append(pub.message, pub.offset);
+    }
+    pub.stats = &stats;
+
+    if (!reactor.retained.empty()) {
+        auto it = reactor.retained.find(pub.topic);
+        if (it != reactor.retained.end()) {
+            pub.own();
+            it->second = pub;
+            it->second.retained = true;
+        }
+    }
+
+    // The snapshots keep every subscriber alive for the fan-out, even one
+    // that is closed and unsubscribed by a failed write along the way.
+    TopicView view = reactor.registry.match(pub.topic);
+    if (view.empty()) {
+        stats.subscribers.set(0);
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    // Encoded once; every subscriber queue, on every shard, shares the
+    // same buffer.
+    pub.own();
+    size_t reached = 0;
+    std::vector<std::vector<ConnectionPtr>> remote;
+    auto route = [&](const ConnectionPtr &sub) {
+        reached++;
+        if (sub->shard == reactor.id) {
+            deliver_message(reactor, sub, pub, view.policy, view.conflate);
+            return;
+        }
+        if (remote.empty()) remote.resize(shards.size());
+        remote[sub->shard].push_back(sub);
+    };
+    view.for_each_subscriber(pub.message, [&](const ConnectionPtr &sub) {
+        if (pub.from_peer && sub->peer) return;
+        route(sub);
+    });
+    for (const GroupView &group : view.groups) {
+        if (!group.members->empty()) route(pick_member(group));
+    }
+
+    for (size_t shard = 0; shard < remote.size(); shard++) {
+        if (remote[shard].empty()) continue;
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::Deliver;
+        msg.pub = pub;
+        msg.targets = std::move(remote[shard]);
+        msg.policy = view.policy;
+        msg.conflate = view.conflate;
+        post(reactor, (int)shard, std::move(msg));
+    }
+
+    stats.subscribers.set(reached);
+    stats.messages_out.add(reached);
+    stats.bytes_out.add(reached * pub.frame.size());
+    stats.fanout.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    return reached > 0;
+}
+
+// Answers a PUBLISH: an Ack frame for a Publish frame, a reply line for
+// the command. An Ack carries the topic's id, announced by a Topic frame
+// just before it. Goes into reply slot seq if the owner was another shard.
+void reply_published(Reactor &reactor, const ConnectionPtr &conn, Publication &pub, bool ack, bool delivered, uint64_t seq) {
+    if (conn->closed) return;
+    bool binary = seq == NO_REPLY ? conn->binary : conn->replies[seq - conn->reply_base].binary;
+
+    PayloadRef frame;
+    if (ack) {
+        uint8_t flags = delivered ? 0 : FLAG_NO_SUBSCRIBERS;
+        char off[8];
+        std::string_view ack_payload;
+        if (pub.logged) {
+            flags |= FLAG_LOGGED;
+            put_u64(off, pub.offset);
+            ack_payload = std::string_view(off, sizeof(off));
+        }
+        if (!announce_topic(conn, pub.id(), pub.topic)) {
+            close_connection(reactor, conn);
+            return;
+        }
+        frame = encode_frame(Opcode::Ack, flags, pub.id(), ack_payload);
+        LOG_DEBUG("Client " << conn->fd << " published " << pub.message.size() << " bytes to '" << pub.topic << "'"
+                            << (delivered ? "" : " but no subscribers"));
+    } else {
+        std::string offset = pub.logged ? " at offset " + std::to_string(pub.offset) : std::string();
+        std::string_view tail = delivered ? "" : " (no subscribers)";
+        if (binary) {
+            PayloadRef line = PayloadRef::concat({"Published to '", pub.topic, "'", offset, tail});
+            frame = encode_frame(Opcode::Reply, 0, 0, line.view());
+        } else {
+            frame = PayloadRef::concat({"Published to '", pub.topic, "'", offset, tail, "\n"});
+        }
+        if (delivered) {
+            LOG_DEBUG("Client " << conn->fd << " published to '" << pub.topic << "': " << pub.message);
+        } else {
+            LOG_DEBUG("Client " << conn->fd << " published to '" << pub.topic << "' but no subscribers");
+        }
+    }
+
+    if (seq == NO_REPLY) {
+        send_reply(reactor, conn, std::move(frame));
+        return;
+    }
+    conn->replies[seq - conn->reply_base].frames.push_back(std::move(frame));
+    complete_reply(reactor, conn, seq);
+}
+
+// Publishes straight away if this shard owns the topic. Otherwise sends
+// pub to the owner, reserving the reply first so it keeps its place among
+// the connection's replies.
+void request_publish(Reactor &reactor, const ConnectionPtr &conn, Publication &pub, bool ack, bool reply) {
+    int owner = owner_of(pub.topic);
+    if (owner == reactor.id) {
+        bool delivered = publish(reactor, pub);
+        if (reply) reply_published(reactor, conn, pub, ack, delivered, NO_REPLY);
+        return;
+    }
+
+    ShardMessage msg;
+    msg.kind = ShardMessage::Kind::Publish;
+    msg.conn = conn;
+    msg.pub = pub;
+    msg.ack = ack;
+    if (reply) msg.reply = reserve_reply(*conn, 1);
+    post(reactor, owner, std::move(msg));
+}
+
+// The retained values of this shard's topics that filter matches, and
+// condition, if any, holds for.
+void collect_retained(const Reactor &reactor, const std::string &filter, const ContentFilterPtr &condition,
+                      std::vector<Publication> &out) {
+    auto wanted = [&](const Publication &last) { return last.frame && (!condition || condition->matches(last.message)); };
+    if (valid_topic_name(filter)) {
+        auto it = reactor.retained.find(filter);
+        if (it != reactor.retained.end() && wanted(it->second)) out.push_back(it->second);
+        return;
+    }
+    for (const auto &[topic, last] : reactor.retained) {
+        if (wanted(last) && topic_matches(filter, topic)) out.push_back(last);
+    }
+}
+
+// The owner's answer to a SUBSCRIBE; the membership handle is kept for
+// unsubscribing without a lookup. Retained values are delivered next: the
+// shard took them when it added the subscription, so any live publish it
+// fans out later lands behind them. Like live messages they can overtake
+// the reply of a wildcard SUBSCRIBE still waiting on other shards.
+void subscribed(Reactor &reactor, ShardMessage &msg) {
+    const ConnectionPtr &conn = msg.conn;
+    if (conn->closed) return;
+
+    std::vector<TopicRegistry::Subscription> *subs = memberships(*conn, msg.filter, msg.group, msg.where);
+    if (subs) (*subs)[msg.from] = std::move(msg.sub);
+
+    auto cursor = conn->cursors.find(msg.filter);
+    if (cursor != conn->cursors.end() && cursor->second.reply == msg.reply) {
+        cursor->second.registered = true;
+        schedule_replay(reactor, conn);
+    }
+    complete_reply(reactor, conn, msg.reply);
+
+    // Not if the client unsubscribed in the meantime.
+    if (!subs) return;
+    for (Publication &pub : msg.retained) deliver_message(reactor, conn, pub, OverflowPolicy::Unset, false);
+}
+
+// This shard's part of a report: the filters in its registry, or the
+// counters of the topics and connections it owns.
+void fill_report(Reactor &reactor, Report &report) {
+    if (report.kind == Report::Topics) {
+        report.topic_lines = reactor.registry.topic_names();
+        return;
+    }
+    if (report.topics) {
+        reactor.metrics.for_each_topic([&](const TopicStats &s) {
+            report.topic_lines.push_back("- " + s.name +
+                " subscribers=" + std::to_string(s.subscribers.get()) +
+                " in=" + std::to_string(s.messages_in.get()) +
+                " in_bytes=" + std::to_string(s.bytes_in.get()) +
+                " out=" + std::to_string(s.messages_out.get()) +
+                " out_bytes=" + std::to_string(s.bytes_out.get()) +
+                " drops=" + std::to_string(s.drops.load(std::memory_order_relaxed)) +
+                " fanout_p50_ns=" + std::to_string(s.fanout.percentile_ns(50)) +
+                " fanout_p99_ns=" + std::to_string(s.fanout.percentile_ns(99)));
+        });
+    }
+    if (report.connections) {
+        reactor.metrics.for_each_connection([&](const ConnectionStats &s) {
+            report.connection_lines.push_back("- fd=" + std::to_string(s.fd) +
+                " shard=" + std::to_string(s.shard) +
+                " in=" + std::to_string(s.messages_in.get()) +
+                " in_bytes=" + std::to_string(s.bytes_in.get()) +
+                " out=" + std::to_string(s.messages_out.get()) +
+                " out_bytes=" + std::to_string(s.bytes_out.get()) +
+                " queued=" + std::to_string(s.queue_depth.get()) +
+                " drops=" + std::to_string(s.drops.get()) +
+                " conflated=" + std::to_string(s.conflated.get()) +
+                " redelivered=" + std::to_string(s.redelivered.get()));
+        });
+    }
+}
+
+// Turns a complete report into the slot's reply lines.
+void finish_report(PendingReply &slot) {
+    Report &report = *slot.report;
+    std::vector<std::string> lines;
+    if (report.kind == Report::Topics) {
+        std::set<std::string> names(report.topic_lines.begin(), report.topic_lines.end());
+        if (names.empty()) lines.push_back("No topics available");
+        else lines.push_back("Active topics:");
+        for (const std::string &name : names) lines.push_back("- " + name);
+    } else {
+        if (report.topics) {
+            lines.push_back("Topic stats:");
+            for (std::string &line : report.topic_lines) lines.push_back(std::move(line));
+        }
+        if (report.connections) {
+            lines.push_back("Connection stats:");
+            for (std::string &line : report.connection_lines) lines.push_back(std::move(line));
+        }
+    }
+    for (const std::string &line : lines) slot.frames.push_back(encode_reply(slot.binary, line));
+    slot.report.reset();
+}
+
+// Asks every shard for its part of a report, this one included, and
+// answers once all of them are in.
+void request_report(Reactor &reactor, const ConnectionPtr &conn, const Report &request) {
+    uint64_t seq = reserve_reply(*conn, shards.size() - 1);
+    PendingReply &slot = conn->replies.back();
+    slot.report = std::make_unique<Report>(request);
+    fill_report(reactor, *slot.report);
+    for (const auto &shard : shards) {
+        if (shard->id == reactor.id) continue;
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::Report;
+        msg.conn = conn;
+        msg.report = std::make_unique<Report>(request);
+        msg.reply = seq;
+        post(reactor, shard->id, std::move(msg));
+    }
+    if (slot.waiting == 0) {
+        finish_report(slot);
+        flush_replies(reactor, conn);
+    }
+}
+
+// One shard's part of a report, merged into the reply slot.
+void report_part(Reactor &reactor, const ConnectionPtr &conn, uint64_t seq, Report &part) {
+    if (conn->closed) return;
+    PendingReply &slot = conn->replies[seq - conn->reply_base];
+    Report &report = *slot.report;
+    for (std::string &line : part.topic_lines) report.topic_lines.push_back(std::move(line));
+    for (std::string &line : part.connection_lines) report.connection_lines.push_back(std::move(line));
+    if (--slot.waiting > 0) return;
+    finish_report(slot);
+    flush_replies(reactor, conn);
+}
+
+void handle_shard_message(Reactor &reactor, ShardMessage &msg) {
+    using Kind = ShardMessage::Kind;
+    switch (msg.kind) {
+    case Kind::Subscribe:
+        if (msg.condition) msg.sub = reactor.registry.add(msg.filter, msg.conn, msg.condition);
+        else msg.sub = reactor.registry.add(msg.filter, msg.conn, msg.group, msg.balance);
+        // A group shares the work of the messages still to come; one that
+        // joins does not redo the last.
+        if (!reactor.retained.empty() && msg.group.empty()) {
+            collect_retained(reactor, msg.filter, msg.condition, msg.retained);
+        }
+        msg.kind = Kind::Subscribed;
+        post(reactor, msg.conn->shard, std::move(msg));
+        break;
+    case Kind::Unsubscribe:
+        // Without a handle (the Subscribed answer has not reached the
+        // connection yet) the filter is looked up.
+        if (!reactor.registry.remove(msg.filter, msg.sub, msg.conn)) {
+            reactor.registry.remove(msg.filter, msg.conn, msg.group, msg.where);
+        }
+        if (msg.reply == NO_REPLY) break;
+        msg.kind = Kind::Unsubscribed;
+        post(reactor, msg.conn->shard, std::move(msg));
+        break;
+    case Kind::SetPolicy:
+        reactor.registry.set_policy(msg.filter, msg.policy);
+        break;
+    case Kind::SetConflate:
+        reactor.registry.set_conflate(msg.filter, msg.conflate);
+        break;
+    case Kind::SetRetain:
+        if (msg.retain) reactor.retained.try_emplace(msg.filter);
+        else reactor.retained.erase(msg.filter);
+        break;
+    case Kind::Publish:
+        msg.delivered = publish(reactor, msg.pub);
+        if (msg.reply == NO_REPLY) break;
+        msg.kind = Kind::Published;
+        post(reactor, msg.conn->shard, std::move(msg));
+        break;
+    case Kind::Deliver:
+        for (const ConnectionPtr &conn : msg.targets) deliver_message(reactor, conn, msg.pub, msg.policy, msg.conflate);
+        break;
+    case Kind::Subscribed:
+        subscribed(reactor, msg);
+        break;
+    case Kind::Unsubscribed:
+        complete_reply(reactor, msg.conn, msg.reply);
+        break;
+    case Kind::Published:
+        reply_published(reactor, msg.conn, msg.pub, msg.ack, msg.delivered, msg.reply);
+        break;
+    case Kind::Interest:
+        sync_interest(reactor, msg.conn, msg.filter);
+        break;
+    case Kind::Report:
+        fill_report(reactor, *msg.report);
+        msg.kind = Kind::Reported;
+        post(reactor, msg.conn->shard, std::move(msg));
+        break;
+    case Kind::Reported:
+        report_part(reactor, msg.conn, msg.reply, *msg.report);
+        break;
+    }
+}
+
+// Runs what the other shards sent, at most INBOX_BATCH from each so one
+// busy sender cannot starve the sockets. Returns true if any inbox still
+// has more.
+bool drain_inbox(Reactor &reactor) {
+    bool more = false;
+    ShardMessagePtr msg;
+    for (size_t from = 0; from < shards.size(); from++) {
+        if ((int)from == reactor.id) continue;
+        SpscQueue<ShardMessagePtr> &inbox = *reactor.inbox[from];
+        for (size_t n = 0; n < INBOX_BATCH && inbox.pop(msg); n++) handle_shard_message(reactor, *msg);
+        if (!inbox.empty()) more = true;
+    }
+    return more;
+}
+
+bool inbox_pending(const Reactor &reactor) {
+    for (size_t from = 0; from < shards.size(); from++) {
+        if ((int)from != reactor.id && !reactor.inbox[from]->empty()) return true;
+    }
+    return false;
+}
+
+// End of a pass: moves held-back messages into inboxes that have room
+// again, then wakes each shard that was sent something while it sleeps.
+// Returns true if some message is still held back.
+bool flush_outbox(Reactor &reactor) {
+    bool held = false;
+    for (size_t to = 0; to < shards.size(); to++) {
+        std::deque<ShardMessagePtr> &backlog = reactor.overflow[to];
+        if (backlog.empty()) continue;
+        SpscQueue<ShardMessagePtr> &inbox = *shards[to]->inbox[reactor.id];
+        while (!backlog.empty() && inbox.push(std::move(backlog.front()))) {
+            backlog.pop_front();
+            reactor.notify[to] = true;
+        }
+        if (!backlog.empty()) held = true;
+    }
+
+    // Pairs with the fence in run_reactor: either the receiver sees the
+    // new messages before it blocks, or this sees it sleeping.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (size_t to = 0; to < shards.size(); to++) {
+        if (!reactor.notify[to]) continue;
+        reactor.notify[to] = false;
+        if (shards[to]->sleeping.load(std::memory_order_relaxed)) {
+            uint64_t one = 1;
+            if (write(shards[to]->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("write");
+        }
+    }
+    return held;
+}
+
+// One "<topic> <message>" line of an MPUBLISH batch. Bad lines are counted
+// and skipped; the whole batch gets a single reply after its last line.
+void handle_batch_line(Reactor &reactor, const ConnectionPtr &conn, std::string_view line) {
+    Publication pub;
+    if (split_topic_message(line, pub.topic, pub.message) && valid_topic_name(pub.topic)) {
+        request_publish(reactor, conn, pub, false, false);
+    } else {
+        conn->batch_rejected++;
+    }
+
+    if (--conn->batch_left > 0) return;
+
+    std::string total = std::to_string(conn->batch_size);
+    if (conn->batch_rejected == 0) {
+        send_reply(reactor, conn, PayloadRef::concat({"Published ", total, " messages\n"}));
+    } else {
+        std::string published = std::to_string(conn->batch_size - conn->batch_rejected);
+        std::string rejected = std::to_string(conn->batch_rejected);
+        send_reply(reactor, conn, PayloadRef::concat({"Published ", published, " of ", total, " messages (", rejected, " rejected)\n"}));
+    }
+    LOG_DEBUG("Client " << conn->fd << " published a batch of " << conn->batch_size << " messages");
+}
+
+// Counters of every shard, one line per topic or connection. Fan-out
+// percentiles are the upper bounds of their histogram buckets.
+// CONFIG QOS and CONFIG WINDOW. Back at QoS 0 whatever was in flight counts
+// as acknowledged, and whatever waited is sent as it is.
+void configure_acks(Reactor &reactor, const ConnectionPtr &conn, std::string_view key, std::string_view value) {
+    uint64_t n;
+    if (key == "QOS" && (!parse_count(value, n) || n > 1)) {
+        send_line_to_client(reactor, conn, "ERROR: usage CONFIG QOS <0|1>");
+        return;
+    }
+    if (key == "WINDOW" && (!parse_count(value, n) || n == 0 || n > MAX_ACK_WINDOW)) {
+        send_line_to_client(reactor, conn, "ERROR: usage CONFIG WINDOW <1-" + std::to_string(MAX_ACK_WINDOW) + ">");
+        return;
+    }
+
+    AckWindow &acks = conn->acks;
+    std::string reply;
+    if (key == "WINDOW") {
+        acks.set_limit(n);
+        fill_window(*conn);
+        reply = "Connection window set to " + std::to_string(n);
+    } else if (n == 1) {
+        acks.enable(ack_window);
+        if (!conn->ack_listed) {
+            conn->ack_listed = true;
+            reactor.acking.push_back(conn);
+        }
+        reply = "Connection QoS 1, window " + std::to_string(acks.limit());
+    } else {
+        acks.disable();
+        while (acks.has_waiting()) {
+            conn->queue.push_reply(acks.take_waiting());
+            conn->stats->messages_out.add();
+        }
+        reply = "Connection QoS 0";
+    }
+    send_line_to_client(reactor, conn, reply);
+    if (!conn->closed) update_queue_stats(*conn);
+}
+
+void handle_line(Reactor &reactor, const ConnectionPtr &conn, std::string_view line) {
+    int client_fd = conn->fd;
+
+    std::string_view args = line;
+    std::string_view cmd = next_token(args);
+
+    if (cmd == "SUBSCRIBE") {
+        // SUBSCRIBE <topic> [FROM <offset|earliest|latest>]
+        // SUBSCRIBE <topic> GROUP <name> [round-robin|least-queued]
+        // SUBSCRIBE <topic> WHERE <expr>
+        static const char usage[] = "ERROR: usage SUBSCRIBE <topic> [FROM <offset|earliest|latest>"
+                                    " | GROUP <name> [round-robin|least-queued] | WHERE <expr>]";
+        std::string topic(next_token(args));
+        std::string_view opt = next_token(args);
+        std::string_view rest = args;
+        std::string_view from = next_token(args);
+        if (topic.empty()) {
+            send_line_to_client(reactor, conn, "ERROR: SUBSCRIBE requires a topic");
+            return;
+        }
+        if (!valid_topic_filter(topic)) {
+            send_line_to_client(reactor, conn, "ERROR: invalid topic filter '" + topic + "'");
+            return;
+        }
+
+        if (opt.empty()) {
+            conn->cursors.erase(topic);
+            subscribe(reactor, conn, topic, "Subscribed to " + topic);
+            LOG_INFO("Client " << client_fd << " subscribed to '" << topic << "'");
+            return;
+        }
+
+        if (opt == "WHERE") {
+            // Compiled here, once; every shard holding the filter runs this
+            // copy, or the one a subscriber with the same condition brought.
+            std::string error;
+            ContentFilterPtr condition = ContentFilter::compile(rest, error);
+            if (!condition) {
+                send_line_to_client(reactor, conn, "ERROR: bad WHERE expression: " + error);
+                return;
             }
+            subscribe(reactor, conn, topic, "Subscribed to " + topic + " where " + condition->text(), {},
+                      GroupBalance::Unset, condition);
+            LOG_INFO("Client " << client_fd << " subscribed to '" << topic << "' where " << condition->text());
+            return;
+        }
+
+        if (opt == "GROUP" && !from.empty()) {
+            // Each message goes to one member; a balance given here is the
+            // group's from now on.
+            std::string group(from);
+            std::string_view mode = next_token(args);
+            GroupBalance balance = GroupBalance::Unset;
+            if (!mode.empty() && !parse_group_balance(mode, balance)) {
+                send_line_to_client(reactor, conn, usage);
+                return;
+            }
+            subscribe(reactor, conn, topic, "Subscribed to " + topic + " in group " + group, group, balance);
+            LOG_INFO("Client " << client_fd << " joined group '" << group << "' of '" << topic << "'");
+            return;
+        }
+
+        if (opt != "FROM" || from.empty()) {
+            send_line_to_client(reactor, conn, usage);
+            return;
+        }
+        if (!message_log.enabled()) {
+            send_line_to_client(reactor, conn, "ERROR: message log is disabled (start the broker with --log-dir)");
+            return;
+        }
+        if (!valid_topic_name(topic)) {
+            send_line_to_client(reactor, conn, "ERROR: FROM needs a concrete topic, not a wildcard");
+            return;
+        }
+        TopicLogPtr log = message_log.topic(topic);
+        if (!log) {
+            send_line_to_client(reactor, conn, "ERROR: cannot open log for '" + topic + "'");
+            return;
+        }
+
+        uint64_t start;
+        if (from == "earliest") start = log->start_offset();
+        else if (from == "latest") start = log->end_offset();
+        else if (!parse_count(from, start)) {
+            send_line_to_client(reactor, conn, "ERROR: bad offset '" + std::string(from) + "'");
+            return;
+        }
+
+        // The cursor exists before the subscription does, so no live
+        // publish can slip past the replay untagged; the replay starts once
+        // the owner has the subscription.
+        LogCursor &cursor = conn->cursors[topic];
+        cursor = LogCursor();
+        cursor.log = log;
+        cursor.reader = log->seek(start);
+        cursor.topic_id = topic_ids.intern(topic);
+        start = cursor.reader.next;
+        subscribe(reactor, conn, topic, "Subscribed to " + topic + " from offset " + std::to_string(start));
+        LOG_INFO("Client " << client_fd << " subscribed to '" << topic << "' from offset " << start);
+    }
+    else if (cmd == "UNSUBSCRIBE") {
+        // UNSUBSCRIBE <topic> [GROUP <name> | WHERE <expr>]
+        if (args.empty()) {
+            send_line_to_client(reactor, conn, "ERROR: UNSUBSCRIBE requires a topic");
+            return;
+        }
+        std::string topic(next_token(args));
+        std::string group, where;
+        if (!args.empty()) {
+            std::string_view opt = next_token(args);
+            std::string error = "missing expression";
+            if (opt == "WHERE") {
+                ContentFilterPtr condition = ContentFilter::compile(args, error);
+                if (condition) where = condition->text();
+            } else if (opt == "GROUP") {
+                group = std::string(next_token(args));
+            }
+            if (opt == "WHERE" && where.empty()) {
+                send_line_to_client(reactor, conn, "ERROR: bad WHERE expression: " + error);
+                return;
+            }
+            if (opt != "WHERE" && (group.empty() || !args.empty())) {
+                send_line_to_client(reactor, conn, "ERROR: usage UNSUBSCRIBE <topic> [GROUP <name> | WHERE <expr>]");
+                return;
+            }
+        }
+        if (group.empty() && where.empty()) conn->cursors.erase(topic);
+
+        // Acknowledged once every holder has dropped the subscription, so
+        // nothing published after the reply is delivered.
+        std::string what = topic;
+        if (!group.empty()) what += " (group " + group + ")";
+        if (!where.empty()) what += " where " + where;
+        PayloadRef reply = encode_reply(conn->binary, "Unsubscribed from " + what);
+        if (std::vector<TopicRegistry::Subscription> *subs = memberships(*conn, topic, group, where)) {
+            unsubscribe(reactor, conn, topic, group, where, *subs,
+                        reserve_reply(*conn, holder_count(topic), std::move(reply)));
+            if (!group.empty()) conn->groups.erase({topic, group});
+            else if (!where.empty()) conn->selections.erase({topic, where});
+            else conn->topics.erase(topic);
+            note_interest(reactor, *conn, topic, false);
+        } else {
+            send_reply(reactor, conn, std::move(reply));
+        }
+        LOG_INFO("Client " << client_fd << " unsubscribed from '" << what << "'");
+    }
+    else if (cmd == "PUBLISH") {
+        Publication pub;
+        if (!split_topic_message(args, pub.topic, pub.message)) {
+            send_line_to_client(reactor, conn, "ERROR: PUBLISH requires topic and message");
+            return;
+        }
+        if (pub.topic.empty()) {
+            send_line_to_client(reactor, conn, "ERROR: empty topic");
+            return;
+        }
+        if (!valid_topic_name(pub.topic)) {
+            send_line_to_client(reactor, conn, "ERROR: cannot publish to a wildcard topic");
+            return;
+        }
+        request_publish(reactor, conn, pub, false, true);
+    }
+    else if (cmd == "MPUBLISH") {
+        // MPUBLISH <count>, followed by <count> lines of "<topic> <message>"
+        if (conn->binary) {
+            send_line_to_client(reactor, conn, "ERROR: MPUBLISH is text-only; pipeline Publish frames instead");
+            return;
+        }
+        uint64_t count;
+        if (!parse_count(next_token(args), count) || count == 0) {
+            send_line_to_client(reactor, conn, "ERROR: usage MPUBLISH <count>, then <count> lines of <topic> <message>");
+            return;
+        }
+        conn->batch_left = conn->batch_size = count;
+        conn->batch_rejected = 0;
+    }
+    else if (cmd == "PROTOCOL") {
+        if (next_token(args) != "BINARY" || conn->binary) {
+            send_line_to_client(reactor, conn, "ERROR: usage PROTOCOL BINARY (from the text protocol)");
+            return;
+        }
+        if (conn->acks.enabled()) {
+            // What is in flight would be resent in the wrong framing.
+            send_line_to_client(reactor, conn, "ERROR: switch protocols before CONFIG QOS 1");
+            return;
+        }
+        // The confirmation is the last text line. Commands after it are
+        // frames right away; published messages only once it is queued.
+        send_reply(reactor, conn, PayloadRef::concat({"Switched to binary protocol\n"}), true);
+        conn->binary = true;
+        LOG_INFO("Client " << client_fd << " switched to the binary protocol");
+    }
+    else if (cmd == "CONFIG") {
+        // CONFIG POLICY <policy>                 -- this connection
+        // CONFIG CONFLATE <on|off>               -- this connection
+        // CONFIG TOPIC <topic> POLICY <policy>   -- everyone subscribed to <topic>
+        // CONFIG TOPIC <topic> CONFLATE <on|off> -- everyone subscribed to <topic>
+        // CONFIG TOPIC <topic> RETAIN <on|off>   -- keep <topic>'s last value for new subscribers
+        // CONFIG QOS <0|1>                       -- this connection, 1: at-least-once
+        // CONFIG WINDOW <n>                      -- this connection's unacknowledged messages at QoS 1
+        std::string_view what = next_token(args);
+        if (what == "QOS" || what == "WINDOW") {
+            configure_acks(reactor, conn, what, next_token(args));
+            return;
+        }
+        std::string_view topic, key, value;
+        if (what == "TOPIC") {
+            topic = next_token(args);
+            key = next_token(args);
+        } else {
+            key = what;
+        }
+        value = next_token(args);
+
+        bool on_topic = what == "TOPIC";
+        bool known = key == "POLICY" || key == "CONFLATE" || (key == "RETAIN" && on_topic);
+        if (!known || (on_topic && topic.empty())) {
+            send_line_to_client(reactor, conn, "ERROR: usage CONFIG [TOPIC <topic>] POLICY <drop-oldest|drop-newest|disconnect>"
+                                               " | CONFLATE <on|off>, CONFIG TOPIC <topic> RETAIN <on|off>,"
+                                               " or CONFIG QOS <0|1> | WINDOW <n>");
+            return;
+        }
+
+        if (key == "POLICY") {
+            OverflowPolicy policy;
+            if (!parse_overflow_policy(value, policy)) {
+                send_line_to_client(reactor, conn, "ERROR: unknown policy '" + std::string(value) + "'");
+                return;
+            }
+            if (on_topic) {
+                for_each_holder(topic, [&](int shard) {
+                    ShardMessage msg;
+                    msg.kind = ShardMessage::Kind::SetPolicy;
+                    msg.filter = std::string(topic);
+                    msg.policy = policy;
+                    post(reactor, shard, std::move(msg));
+                });
+                send_line_to_client(reactor, conn, "Topic '" + std::string(topic) + "' policy set to " + overflow_policy_name(policy));
+            } else {
+                conn->policy = policy;
+                send_line_to_client(reactor, conn, std::string("Connection policy set to ") + overflow_policy_name(policy));
+            }
+            return;
+        }
+
+        bool enable;
+        if (!parse_switch(value, enable)) {
+            send_line_to_client(reactor, conn, "ERROR: expected on or off, got '" + std::string(value) + "'");
+            return;
+        }
+        std::string state = enable ? "on" : "off";
+        if (key == "RETAIN") {
+            // Kept by the owner alone, which sees every publish to it.
+            if (!valid_topic_name(topic)) {
+                send_line_to_client(reactor, conn, "ERROR: RETAIN needs a concrete topic, not a wildcard");
+                return;
+            }
+            ShardMessage msg;
+            msg.kind = ShardMessage::Kind::SetRetain;
+            msg.filter = std::string(topic);
+            msg.retain = enable;
+            post(reactor, owner_of(topic), std::move(msg));
+            send_line_to_client(reactor, conn, "Topic '" + std::string(topic) + "' retain " + state);
+        } else if (on_topic) {
+            for_each_holder(topic, [&](int shard) {
+                ShardMessage msg;
+                msg.kind = ShardMessage::Kind::SetConflate;
+                msg.filter = std::string(topic);
+                msg.conflate = enable;
+                post(reactor, shard, std::move(msg));
+            });
+            send_line_to_client(reactor, conn, "Topic '" + std::string(topic) + "' conflation " + state);
+        } else {
+            conn->conflate = enable;
+            send_line_to_client(reactor, conn, "Connection conflation " + state);
+        }
+    }
+    else if (cmd == "ACK") {
+        // ACK <seq>: every QoS 1 message up to <seq> arrived. Silent unless
+        // it is wrong.
+        uint64_t seq;
+        if (!parse_count(next_token(args), seq)) {
+            send_line_to_client(reactor, conn, "ERROR: usage ACK <sequence>");
+            return;
+        }
+        if (!conn->acks.enabled()) {
+            send_line_to_client(reactor, conn, "ERROR: ACK needs CONFIG QOS 1");
+            return;
+        }
+        if (!conn->acks.ack(seq)) {
+            send_line_to_client(reactor, conn, "ERROR: nothing was sent as " + std::to_string(seq) + " yet");
+            return;
+        }
+        bool was_empty = conn->queue.empty();
+        fill_window(*conn);
+        if (was_empty && !conn->queue.empty() && !send_queued(conn)) {
+            close_connection(reactor, conn);
+            return;
+        }
+        update_queue_stats(*conn);
+    }
+    else if (cmd == "PEER") {
+        // PEER <broker id>: first line of a broker dialing this one; frames
+        // follow, both ways, unless it is already linked to this one.
+        if (!federation.enabled) {
+            send_line_to_client(reactor, conn, "ERROR: federation is disabled (start the broker with --federate)");
+            return;
+        }
+        if (conn->binary || !conn->topics.empty() || !conn->groups.empty() || !conn->selections.empty()) {
+            send_line_to_client(reactor, conn, "ERROR: PEER must come before any subscription or protocol switch");
+            return;
+        }
+        uint64_t broker;
+        if (!parse_count(next_token(args), broker) || broker == 0) {
+            send_line_to_client(reactor, conn, "ERROR: usage PEER <broker id>");
+            return;
+        }
+        if (!start_link(reactor, conn, broker)) {
+            send_line_to_client(reactor, conn, "PEER " + std::to_string(federation.id) + " LINKED");
+            LOG_INFO("Client " << client_fd << " refused: already linked to broker " << broker);
+        }
+    }
+    else if (cmd == "STATS") {
+        // STATS [TOPICS|CONNECTIONS]
+        std::string_view what = next_token(args);
+        if (!what.empty() && what != "TOPICS" && what != "CONNECTIONS") {
+            send_line_to_client(reactor, conn, "ERROR: usage STATS [TOPICS|CONNECTIONS]");
+            return;
+        }
+        Report request;
+        request.kind = Report::Stats;
+        request.topics = what != "CONNECTIONS";
+        request.connections = what != "TOPICS";
+        request_report(reactor, conn, request);
+    }
+    else if (cmd == "LIST") {
+        if (line == "LIST TOPICS") {
+            // Every shard lists the filters in its own registry.
+            Report request;
+            request.kind = Report::Topics;
+            request_report(reactor, conn, request);
+        } else {
+            send_line_to_client(reactor, conn, "ERROR: unknown LIST command");
+        }
+    }
+    else {
+        send_line_to_client(reactor, conn, "ERROR: unknown command");
+    }
+}
+
+// A Publish frame: by topic id, or by name on first use. The ack carries the
+// id to use from then on.
+void handle_binary_publish(Reactor &reactor, const ConnectionPtr &conn, const FrameHeader &header, std::string_view payload) {
+    Publication pub;
+    if (header.topic_id != 0) {
+        const std::string *name = topic_ids.name(header.topic_id);
+        if (!name) {
+            send_line_to_client(reactor, conn, "ERROR: unknown topic id " + std::to_string(header.topic_id));
+            return;
+        }
+        pub.topic = *name;
+        pub.topic_id = header.topic_id;
+        pub.message = payload;
+    } else {
+        size_t len = payload.size() >= 2 ? get_u16(payload.data()) : 0;
+        if (payload.size() < 2 || len > payload.size() - 2) {
+            send_line_to_client(reactor, conn, "ERROR: malformed Publish frame");
+            return;
+        }
+        pub.topic = payload.substr(2, len);
+        pub.message = payload.substr(2 + len);
+    }
+    if (!valid_topic_name(pub.topic)) {
+        send_line_to_client(reactor, conn, "ERROR: cannot publish to a wildcard topic");
+        return;
+    }
+    request_publish(reactor, conn, pub, true, true);
+}
+
+// What comes in over a peer link: the peer's interest, as commands, and
+// what was published there to topics this broker is interested in. Its
+// replies and retained values are not for us.
+void handle_peer_frame(Reactor &reactor, const ConnectionPtr &conn, const FrameHeader &header, std::string_view payload) {
+    switch (header.opcode) {
+    case Opcode::Command:
+        handle_line(reactor, conn, payload);
+        break;
+    case Opcode::Topic:
+        conn->peer_topics[header.topic_id] = std::string(payload);
+        break;
+    case Opcode::Message: {
+        if (header.flags & FLAG_RETAINED) break;
+        if (header.flags & FLAG_LOGGED) {
+            if (payload.size() < 8) break;
+            payload.remove_prefix(8);
+        }
+        auto it = conn->peer_topics.find(header.topic_id);
+        if (it == conn->peer_topics.end()) break;
+        Publication pub;
+        pub.topic = it->second;
+        pub.message = payload;
+        pub.from_peer = true;
+        request_publish(reactor, conn, pub, false, false);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void handle_frame(Reactor &reactor, const ConnectionPtr &conn, const FrameHeader &header, std::string_view payload) {
+    if (conn->peer) {
+        handle_peer_frame(reactor, conn, header, payload);
+        return;
+    }
+    switch (header.opcode) {
+    case Opcode::Command:
+        handle_line(reactor, conn, payload);
+        break;
+    case Opcode::Publish:
+        handle_binary_publish(reactor, conn, header, payload);
+        break;
+    default:
+        send_line_to_client(reactor, conn, "ERROR: unexpected opcode " + std::to_string((int)header.opcode));
+        break;
+    }
+}
+
+// Runs every complete frame in the input buffer. Returns false if the
+// connection was closed for sending one that can never fit.
+bool handle_frames(Reactor &reactor, const ConnectionPtr &conn) {
+    while (!conn->closed) {
+        std::string_view pending = conn->in.pending();
+        if (pending.size() < FRAME_HEADER_SIZE) break;
+
+        FrameHeader header = decode_frame_header(pending.data());
+        if (header.length > LineBuffer::MAX_SIZE - FRAME_HEADER_SIZE) {
+            send_line_to_client(reactor, conn, "ERROR: frame too large");
+            close_connection(reactor, conn);
+            return false;
+        }
+        if (pending.size() < FRAME_HEADER_SIZE + header.length) break;
+
+        conn->stats->messages_in.add();
+        handle_frame(reactor, conn, header, pending.substr(FRAME_HEADER_SIZE, header.length));
+        conn->in.consume(FRAME_HEADER_SIZE + header.length);
+    }
+    return true;
+}
+
+// Runs every complete command or frame in the input buffer. A PROTOCOL
+// BINARY line switches the rest of the buffer over.
+void handle_input(Reactor &reactor, const ConnectionPtr &conn) {
+    std::string_view line;
+    while (!conn->closed && !conn->binary && conn->in.next_line(line)) {
+        conn->stats->messages_in.add();
+        if (conn->batch_left > 0) handle_batch_line(reactor, conn, line);
+        else if (!line.empty()) handle_line(reactor, conn, line);
+    }
+    if (conn->binary) handle_frames(reactor, conn);
+}
+
+// Edge-triggered: read until EAGAIN. Every complete command in a read is
+// run before the next read, however many a client pipelined into it.
+void handle_readable(Reactor &reactor, const ConnectionPtr &conn) {
+    while (!conn->closed) {
+        auto [space, room] = conn->in.write_area();
+        if (room == 0) {
+            send_line_to_client(reactor, conn, "ERROR: line too long");
+            close_connection(reactor, conn);
+            break;
+        }
+
+        ssize_t r = read(conn->fd, space, room);
+        if (r > 0) {
+            conn->in.commit((size_t)r);
+            conn->stats->bytes_in.add((uint64_t)r);
+            handle_input(reactor, conn);
         }
         else if (r == 0) {
-            std::cout << "Client " << client_fd << " disconnected (EOF)\n";
+            LOG_INFO("Client " << conn->fd << " disconnected (EOF)");
+            close_connection(reactor, conn);
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
             break;
         }
         else {
             perror("read");
+            close_connection(reactor, conn);
+        }
+    }
+    conn->in.release_if_empty();
+    if (!conn->closed) update_queue_stats(*conn);
+}
+
+// The queue has emptied, so a replay held back by it can go on.
+void resume_replay(Reactor &reactor, const ConnectionPtr &conn) {
+    bool replay = conn->queue.empty() && std::any_of(conn->cursors.begin(), conn->cursors.end(), [](const auto &kv) {
+                      return kv.second.registered && !kv.second.live;
+                  });
+    if (replay) schedule_replay(reactor, conn);
+}
+
+void handle_writable(Reactor &reactor, const ConnectionPtr &conn) {
+    if (conn->closed) return;
+    if (!conn->queue.drain(conn->fd)) {
+        close_connection(reactor, conn);
+        return;
+    }
+    update_queue_stats(*conn);
+    resume_replay(reactor, conn);
+}
+
+// What a completion on an io_uring shard was for. Sockets stay open until
+// their last operation completes, so the number identifies the connection.
+enum class RingOp : uint8_t { Accept, Wake, Recv, Send };
+
+uint64_t ring_data(int fd, RingOp op) {
+    return (uint64_t)(uint32_t)fd << 8 | (uint64_t)op;
+}
+
+void arm_recv(Reactor &reactor, const ConnectionPtr &conn) {
+    if (!reactor.ring->recv_multishot(conn->fd, RECV_GROUP, ring_data(conn->fd, RingOp::Recv))) {
+        close_connection(reactor, conn);
+        return;
+    }
+    conn->ring_ops++;
+}
+
+// Puts a socket under this shard. Closes it on failure.
+ConnectionPtr add_connection(Reactor &reactor, int fd) {
+    if (reactor.ring) {
+        // io_uring waits for the socket itself; a non-blocking one would
+        // hand EAGAIN back instead.
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0 && (flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    } else {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(fd);
+            return nullptr;
+        }
+    }
+
+    auto conn = std::make_shared<Connection>();
+    conn->fd = fd;
+    conn->shard = reactor.id;
+    conn->stats = std::make_shared<ConnectionStats>(fd, reactor.id);
+    reactor.metrics.add_connection(conn->stats);
+    reactor.connections[fd] = conn;
+    if (reactor.ring) arm_recv(reactor, conn);
+    return conn;
+}
+
+void accept_clients(Reactor &reactor) {
+    while (true) {
+        int client_fd = accept4(reactor.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        if (add_connection(reactor, client_fd)) {
+            LOG_INFO("New client connected: fd=" << client_fd << " (shard " << reactor.id << ")");
+        }
+    }
+}
+
+// Takes over the links the dialer connected for this shard.
+void adopt_links(Reactor &reactor) {
+    std::vector<std::pair<int, PeerTarget *>> adopted;
+    {
+        std::lock_guard<std::mutex> lock(reactor.adopt_mutex);
+        adopted.swap(reactor.adopted);
+    }
+    for (auto [fd, target] : adopted) {
+        ConnectionPtr link = add_connection(reactor, fd);
+        if (!link) {
+            target->up.store(false);
+            continue;
+        }
+        link->dialed = target;
+        if (!start_link(reactor, link, target->broker.load())) {
+            LOG_INFO("Peer " << target->host << ":" << target->port << " is already linked");
+            target->up.store(false);
+            close_connection(reactor, link);
+        }
+    }
+}
+
+// Copies what a multishot receive got out of its provided buffer and runs
+// it, a buffer's worth at a time if the line buffer is short of room.
+void handle_received(Reactor &reactor, const ConnectionPtr &conn, const char *data, size_t len) {
+    conn->stats->bytes_in.add(len);
+    while (len > 0 && !conn->closed) {
+        auto [space, room] = conn->in.write_area();
+        if (room == 0) {
+            send_line_to_client(reactor, conn, "ERROR: line too long");
+            close_connection(reactor, conn);
             break;
         }
+        size_t n = std::min(room, len);
+        std::memcpy(space, data, n);
+        conn->in.commit(n);
+        data += n;
+        len -= n;
+        handle_input(reactor, conn);
+    }
+    conn->in.release_if_empty();
+    if (!conn->closed) update_queue_stats(*conn);
+}
+
+void handle_ring_recv(Reactor &reactor, const ConnectionPtr &conn, const io_uring_cqe &cqe) {
+    if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+        uint16_t bid = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (!conn->closed) handle_received(reactor, conn, reactor.ring->buffer(bid), (size_t)cqe.res);
+        reactor.ring->recycle(bid);
+    } else if (conn->closed) {
+        // Ended by the shutdown in close_connection.
+    } else if (cqe.res == 0) {
+        LOG_INFO("Client " << conn->fd << " disconnected (EOF)");
+        close_connection(reactor, conn);
+    } else if (cqe.res != -ENOBUFS) {
+        LOG_WARN("Client " << conn->fd << " receive failed: " << std::strerror(-cqe.res));
+        close_connection(reactor, conn);
+    }
+
+    // Out of buffers, or the kernel ended it: receive again.
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        conn->ring_ops--;
+        if (!conn->closed) arm_recv(reactor, conn);
+    }
+}
+
+void handle_ring_send(Reactor &reactor, const ConnectionPtr &conn, const io_uring_cqe &cqe) {
+    conn->sending = false;
+    conn->ring_ops--;
+    conn->queue.sent(cqe.res > 0 ? (size_t)cqe.res : 0);
+    if (conn->closed) return;
+    if (cqe.res < 0) {
+        close_connection(reactor, conn);
+        return;
+    }
+    update_queue_stats(*conn);
+    if (!conn->queue.empty()) send_queued(conn);
+    else resume_replay(reactor, conn);
+}
+
+void handle_completion(Reactor &reactor, const io_uring_cqe &cqe) {
+    int fd = (int)(cqe.user_data >> 8);
+    RingOp op = (RingOp)(cqe.user_data & 0xff);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    if (op == RingOp::Accept) {
+        if (cqe.res >= 0 && add_connection(reactor, cqe.res)) {
+            LOG_INFO("New client connected: fd=" << cqe.res << " (shard " << reactor.id << ")");
+        }
+        if (!more) reactor.ring->accept_multishot(reactor.listen_fd, ring_data(reactor.listen_fd, RingOp::Accept));
+        return;
+    }
+    if (op == RingOp::Wake) {
+        uint64_t count;
+        if (read(reactor.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("read");
+        adopt_links(reactor);
+        if (!more) reactor.ring->poll_multishot(reactor.wake_fd, ring_data(reactor.wake_fd, RingOp::Wake));
+        return;
     }
 
-    cleanup_client(client_fd);
-    close(client_fd);
+    auto it = reactor.connections.find(fd);
+    if (it == reactor.connections.end()) return;
+    ConnectionPtr conn = it->second;
+    if (op == RingOp::Recv) handle_ring_recv(reactor, conn, cqe);
+    else handle_ring_send(reactor, conn, cqe);
+    if (conn->closed && conn->ring_ops == 0) release_socket(reactor, *conn);
+}
+
+// One write for every connection that got something to send during the
+// pass; the next wait submits them all in a single system call.
+void submit_sends(Reactor &reactor) {
+    std::vector<ConnectionPtr> batch;
+    batch.swap(reactor.sending);
+    for (const ConnectionPtr &conn : batch) {
+        conn->send_scheduled = false;
+        if (conn->closed || conn->sending || conn->queue.empty()) continue;
+
+        if (!conn->send) conn->send = std::make_unique<RingSend>();
+        RingSend &send = *conn->send;
+        send.msg = msghdr{};
+        send.msg.msg_iov = send.iov;
+        send.msg.msg_iovlen = (size_t)conn->queue.gather(send.iov, OutboundQueue::MAX_IOV);
+        if (!reactor.ring->sendmsg(conn->fd, &send.msg, ring_data(conn->fd, RingOp::Send))) {
+            conn->queue.sent(0);
+            close_connection(reactor, conn);
+            continue;
+        }
+        conn->sending = true;
+        conn->ring_ops++;
+    }
+}
+
+// Sends a QoS 1 subscriber its whole window again once the oldest message
+// in it has gone unacknowledged for ack_timeout, unless the socket is still
+// busy with what is queued. Connections closed or back at QoS 0 leave the
+// list.
+void redeliver_expired(Reactor &reactor) {
+    auto now = AckWindow::Clock::now();
+    if (now < reactor.next_ack_check) return;
+    reactor.next_ack_check = now + ACK_CHECK_INTERVAL;
+
+    std::vector<ConnectionPtr> &acking = reactor.acking;
+    for (size_t i = 0; i < acking.size();) {
+        ConnectionPtr conn = acking[i];
+        if (conn->closed || !conn->acks.enabled()) {
+            conn->ack_listed = false;
+            acking[i] = std::move(acking.back());
+            acking.pop_back();
+            continue;
+        }
+        i++;
+        if (!conn->queue.empty() || !conn->acks.expired(now, ack_timeout)) continue;
+        conn->acks.resend(now, [&](const PayloadRef &frame) { conn->queue.push_reply(frame); });
+        if (!send_queued(conn)) close_connection(reactor, conn);
+        else update_queue_stats(*conn);
+    }
+}
+
+// How long the coming wait may block: not at all while some subscriber is
+// still replaying or an inbox has more, a millisecond while messages are
+// held back, and no longer than the next ACK timeout check. A shard about
+// to block is marked sleeping, so senders know to wake it.
+int wait_timeout(Reactor &reactor, bool held) {
+    int timeout = !reactor.replaying.empty() ? 0 : held ? 1 : -1;
+    if (timeout < 0 && !reactor.acking.empty()) timeout = (int)ACK_CHECK_INTERVAL.count();
+    if (timeout != 0) {
+        reactor.sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (inbox_pending(reactor)) timeout = 0;
+    }
+    return timeout;
+}
+
+// The end of every pass, whatever the backend: the other shards' messages,
+// the replays, then the messages for other shards. Returns true if some
+// message is still held back.
+bool finish_pass(Reactor &reactor) {
+    drain_inbox(reactor);
+    if (!reactor.acking.empty()) redeliver_expired(reactor);
+
+    if (!reactor.replaying.empty()) {
+        std::vector<ConnectionPtr> pending;
+        pending.swap(reactor.replaying);
+        for (const ConnectionPtr &conn : pending) {
+            conn->replay_scheduled = false;
+            if (pump_replay(reactor, conn)) schedule_replay(reactor, conn);
+        }
+    }
+
+    bool held = flush_outbox(reactor);
+
+    // Connections closed during this pass are only dropped here so no
+    // reference held above is invalidated mid-dispatch.
+    for (int fd : reactor.closed_fds) {
+        auto it = reactor.connections.find(fd);
+        if (it != reactor.connections.end() && it->second->closed) reactor.connections.erase(it);
+    }
+    reactor.closed_fds.clear();
+    return held;
+}
+
+// The io_uring event loop: completions instead of readiness, and every
+// write of a pass submitted together with the wait that ends it.
+void run_ring_reactor(Reactor &reactor) {
+    reactor.ring = std::make_unique<Uring>();
+    Uring &ring = *reactor.ring;
+    if (!ring.init(RING_ENTRIES) || !ring.setup_buffers(RECV_GROUP, RECV_BUFFERS, RECV_BUFFER_SIZE)) {
+        perror("io_uring");
+        std::exit(1);
+    }
+    ring.accept_multishot(reactor.listen_fd, ring_data(reactor.listen_fd, RingOp::Accept));
+    ring.poll_multishot(reactor.wake_fd, ring_data(reactor.wake_fd, RingOp::Wake));
+
+    bool held = false;
+    while (true) {
+        submit_sends(reactor);
+        ring.wait(wait_timeout(reactor, held));
+        reactor.sleeping.store(false, std::memory_order_relaxed);
+        ring.for_each_completion([&](const io_uring_cqe &cqe) { handle_completion(reactor, cqe); });
+        held = finish_pass(reactor);
+    }
+}
+
+void run_reactor(Reactor &reactor) {
+    if (use_uring) {
+        run_ring_reactor(reactor);
+        return;
+    }
+
+    for (int fd : {reactor.listen_fd, reactor.wake_fd}) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return;
+        }
+    }
+
+    epoll_event events[MAX_EVENTS];
+    bool held = false;
+    while (true) {
+        int n = epoll_wait(reactor.epoll_fd, events, MAX_EVENTS, wait_timeout(reactor, held));
+        reactor.sleeping.store(false, std::memory_order_relaxed);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == reactor.listen_fd) {
+                accept_clients(reactor);
+                continue;
+            }
+            if (fd == reactor.wake_fd) {
+                uint64_t count;
+                if (read(reactor.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("read");
+                adopt_links(reactor);
+                continue;
+            }
+
+            auto it = reactor.connections.find(fd);
+            if (it == reactor.connections.end()) continue;
+            ConnectionPtr conn = it->second;
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                handle_readable(reactor, conn);
+            }
+            if (!conn->closed && (events[i].events & EPOLLOUT)) {
+                handle_writable(reactor, conn);
+            }
+        }
+
+        held = finish_pass(reactor);
+    }
 }
 
-int main() {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
+// Every shard listens on the port with a non-blocking socket of its own;
+// SO_REUSEPORT has the kernel spread incoming connections across them. The
+// admin port gets a plain blocking socket.
+int open_listener(in_addr_t address, int port, bool shard) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (shard ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0) {
         perror("socket");
-        return 1;
+        return -1;
     }
 
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (shard && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
         perror("setsockopt");
-        close(server_fd);
-        return 1;
+        close(fd);
+        return -1;
     }
 
     sockaddr_in addr;
     std::memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(address);
+    addr.sin_port = htons(port);
 
-    if (bind(server_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
         perror("bind");
-        close(server_fd);
-        return 1;
+        close(fd);
+        return -1;
     }
 
-    if (listen(server_fd, 10) < 0) {
+    if (listen(fd, SOMAXCONN) < 0) {
         perror("listen");
-        close(server_fd);
-        return 1;
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    std::cout << "PubSub server listening on port " << PORT << "\n";
+// Keeps a shard on one CPU, so its connections, registry and inboxes stay
+// in that core's caches. Best effort: a restricted cpuset just says no.
+void pin_to_cpu(std::thread &thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+// Answers every connection to the admin port with the Prometheus dump,
+// whatever path it asked for. One scrape at a time; they are rare and the
+// counters are read without stopping the shards.
+void run_admin(int listen_fd) {
+    std::vector<const ShardMetrics *> metrics;
+    for (const auto &shard : shards) metrics.push_back(&shard->metrics);
 
-    std::vector<std::thread> workers;
     while (true) {
-        int client_fd = accept(server_fd, nullptr, nullptr);
-        if (client_fd < 0) {
-            perror("accept");
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR) perror("accept");
             continue;
         }
 
-        std::cout << "New client connected: fd=" << client_fd << "\n";
-        workers.emplace_back(std::thread(handle_client, client_fd));
-        workers.back().detach();
+        // Read (and ignore) the request head, giving up on a silent client.
+        timeval timeout{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string request;
+        char buf[4096];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < sizeof(buf) * 16) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) break;
+            request.append(buf, (size_t)n);
+        }
+
+        std::string body = render_prometheus(metrics);
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t done = 0;
+        while (done < response.size()) {
+            ssize_t n = write(fd, response.data() + done, response.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += (size_t)n;
+        }
+        close(fd);
+    }
+}
+
+// A blocking connect to the peer that introduces itself with PEER and reads
+// back the peer's id, then a non-blocking socket for a shard to take over;
+// -1 if it is not reachable, or already linked to this broker.
+int dial_peer(PeerTarget &target) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addrs = nullptr;
+    if (getaddrinfo(target.host.c_str(), std::to_string(target.port).c_str(), &hints, &addrs) != 0) return -1;
+
+    int fd = -1;
+    for (addrinfo *a = addrs; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
     }
+    freeaddrinfo(addrs);
+    if (fd < 0) return -1;
+
+    std::string hello = "PEER " + std::to_string(federation.id) + "\n";
+    if (write(fd, hello.data(), hello.size()) != (ssize_t)hello.size()) {
+        close(fd);
+        return -1;
+    }
+
+    // The answer is one line, read a byte at a time so the frames behind
+    // it stay in the socket for the shard.
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string answer;
+    char ch;
+    while (answer.size() < 64 && read(fd, &ch, 1) == 1 && ch != '\n') answer.push_back(ch);
+    std::string_view rest = answer;
+    uint64_t broker;
+    if (next_token(rest) != "PEER" || !parse_count(next_token(rest), broker)) {
+        LOG_INFO("Peer " << target.host << ":" << target.port << " did not accept the link: " << answer);
+        close(fd);
+        return -1;
+    }
+    target.broker.store(broker);
+
+    int flags = fcntl(fd, F_GETFL);
+    if (!rest.empty() || flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    close(server_fd);
+// Whether a link to the broker with this id is up, whichever side dialed.
+bool linked_to(uint64_t broker) {
+    std::lock_guard<std::mutex> lock(federation.mutex);
+    return broker == federation.id || federation.links.count(broker) > 0;
+}
+
+// Keeps a link up to every --peer: once a second, dials those that are down,
+// unless the peer dialed this broker instead, and hands each new link to a
+// shard, round robin.
+void run_dialer() {
+    size_t next = 0;
+    while (true) {
+        for (PeerTarget &target : federation.targets) {
+            if (target.up.load()) continue;
+            uint64_t broker = target.broker.load();
+            if (broker != 0 && linked_to(broker)) continue;
+            int fd = dial_peer(target);
+            if (fd < 0) {
+                LOG_DEBUG("Peer " << target.host << ":" << target.port << " not reachable");
+                continue;
+            }
+            LOG_INFO("Connected to peer " << target.host << ":" << target.port);
+            target.up.store(true);
+
+            Reactor &shard = *shards[next++ % shards.size()];
+            {
+                std::lock_guard<std::mutex> lock(shard.adopt_mutex);
+                shard.adopted.emplace_back(fd, &target);
+            }
+            uint64_t one = 1;
+            if (write(shard.wake_fd, &one, sizeof(one)) < 0) perror("write");
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+// Lets a single broker hold as many sockets as the hard limit allows.
+void raise_fd_limit() {
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    int num_cpus = (int)std::thread::hardware_concurrency();
+    int num_threads = num_cpus;
+    int port = PORT;
+    int admin_port = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            num_threads = std::atoi(argv[++i]);
+        } else if (arg == "--queue-limit" && i + 1 < argc) {
+            queue_limit = (size_t)std::atol(argv[++i]);
+        } else if (arg == "--overflow-policy" && i + 1 < argc && parse_overflow_policy(argv[i + 1], default_policy)) {
+            i++;
+        } else if (arg == "--ack-window" && i + 1 < argc) {
+            ack_window = std::clamp<size_t>((size_t)std::atol(argv[++i]), 1, MAX_ACK_WINDOW);
+        } else if (arg == "--ack-timeout-ms" && i + 1 < argc) {
+            ack_timeout = std::chrono::milliseconds(std::max(1L, std::atol(argv[++i])));
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            if (!message_log.open(argv[++i])) return 1;
+        } else if (arg == "--admin-port" && i + 1 < argc) {
+            admin_port = std::atoi(argv[++i]);
+        } else if (arg == "--port" && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--io" && i + 1 < argc && (std::strcmp(argv[i + 1], "epoll") == 0 ||
+                                                    std::strcmp(argv[i + 1], "uring") == 0)) {
+            use_uring = std::strcmp(argv[++i], "uring") == 0;
+        } else if (arg == "--federate") {
+            federation.enabled = true;
+        } else if (arg == "--peer" && i + 1 < argc && std::strrchr(argv[i + 1], ':')) {
+            // Implies --federate.
+            std::string peer = argv[++i];
+            size_t colon = peer.rfind(':');
+            PeerTarget &target = federation.targets.emplace_back();
+            target.host = peer.substr(0, colon);
+            target.port = std::atoi(peer.c_str() + colon + 1);
+            federation.enabled = true;
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--port PORT] [--threads N] [--queue-limit N]"
+                      << " [--overflow-policy drop-oldest|drop-newest|disconnect]"
+                      << " [--ack-window N] [--ack-timeout-ms MS]"
+                      << " [--log-dir DIR] [--admin-port PORT] [--federate] [--peer HOST:PORT]..."
+                      << " [--io epoll|uring]\n";
+            return 1;
+        }
+    }
+    if (num_threads < 1) num_threads = 1;
+    if (use_uring && !Uring::probe()) {
+        LOG_WARN("io_uring with multishot receive is not available here; falling back to epoll");
+        use_uring = false;
+    }
+
+    // Every shard, with its listening socket and inboxes, exists before any
+    // of them runs.
+    for (int i = 0; i < num_threads; i++) {
+        auto shard = std::make_unique<Reactor>();
+        shard->id = i;
+        shard->listen_fd = open_listener(INADDR_ANY, port, true);
+        shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        // io_uring shards have no epoll instance and keep epoll_fd at -1.
+        if (!use_uring) shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (use_uring && shard->listen_fd >= 0) {
+            // io_uring waits for connections itself.
+            fcntl(shard->listen_fd, F_SETFL, fcntl(shard->listen_fd, F_GETFL) & ~O_NONBLOCK);
+        }
+        if (shard->listen_fd < 0 || shard->wake_fd < 0 || (!use_uring && shard->epoll_fd < 0)) {
+            if (shard->wake_fd < 0) perror("eventfd");
+            if (!use_uring && shard->epoll_fd < 0) perror("epoll_create1");
+            return 1;
+        }
+        shard->inbox.resize(num_threads);
+        for (int from = 0; from < num_threads; from++) {
+            if (from != i) shard->inbox[from] = std::make_unique<SpscQueue<ShardMessagePtr>>(INBOX_CAPACITY);
+        }
+        shard->overflow.resize(num_threads);
+        shard->notify.resize(num_threads);
+        shards.push_back(std::move(shard));
+    }
+
+    LOG_INFO("PubSub server listening on port " << port << " (" << num_threads << " shards, "
+                                                 << (use_uring ? "io_uring" : "epoll") << ")");
+
+    // Metrics are only served on the loopback interface.
+    if (admin_port > 0) {
+        int admin_fd = open_listener(INADDR_LOOPBACK, admin_port, false);
+        if (admin_fd < 0) return 1;
+        std::thread(run_admin, admin_fd).detach();
+        LOG_INFO("Prometheus metrics on 127.0.0.1:" << admin_port);
+    }
+
+    if (federation.enabled) {
+        std::random_device random;
+        federation.id = ((uint64_t)random() << 32 | random()) | 1;
+    }
+
+    std::vector<std::thread> reactors;
+    for (int i = 0; i < num_threads; i++) {
+        reactors.emplace_back(run_reactor, std::ref(*shards[i]));
+        if (num_cpus > 0) pin_to_cpu(reactors.back(), i % num_cpus);
+    }
+    if (!federation.targets.empty()) std::thread(run_dialer).detach();
+    for (auto &t : reactors) t.join();
     return 0;
 }
@@ -0,0 +1,64 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Bounded lock-free queue from exactly one producer thread to exactly one
+// consumer thread, used to pass requests and results between shards.
+//
+// The ring is indexed by free-running counters; each side owns one counter
+// and only reads the other's when its cached copy says the ring looks full
+// (or empty), so in steady state a push or pop touches no cache line the
+// other thread is writing. Capacity must be a power of two.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(new T[capacity]), mask(capacity - 1) {}
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // Producer only. Leaves value untouched and returns false when full.
+    bool push(T &&value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head_cache > mask) {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t - head_cache > mask) return false;
+        }
+        slots[t & mask] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    bool pop(T &value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail_cache) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h == tail_cache) return false;
+        }
+        value = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    bool empty() const { return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire); }
+
+private:
+    std::unique_ptr<T[]> slots;
+    const size_t mask;
+
+    // Consumer side: next slot to read, and the last tail it saw.
+    alignas(64) std::atomic<size_t> head{0};
+    size_t tail_cache = 0;
+
+    // Producer side: next slot to write, and the last head it saw.
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t head_cache = 0;
+};
+
+#endif // SPSC_QUEUE_H
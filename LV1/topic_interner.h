@@ -0,0 +1,49 @@
+#ifndef TOPIC_INTERNER_H
+#define TOPIC_INTERNER_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Topic name <-> numeric id, shared by every connection so a binary frame
+// can be encoded once for all subscribers. Ids start at 1 (0 means "no
+// id") and are never reused; a name keeps its id for the broker's
+// lifetime.
+class TopicInterner {
+public:
+    uint32_t intern(std::string_view topic) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = ids.find(topic);
+            if (it != ids.end()) return it->second;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = ids.find(topic);
+        if (it != ids.end()) return it->second;
+        names.emplace_back(topic);
+        uint32_t id = (uint32_t)names.size();
+        ids.emplace(names.back(), id);
+        return id;
+    }
+
+    // The name of an id, or nullptr if it was never handed out. The
+    // string stays valid for the interner's lifetime.
+    const std::string *name(uint32_t id) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        if (id == 0 || id > names.size()) return nullptr;
+        return &names[id - 1];
+    }
+
+private:
+    mutable std::shared_mutex mutex;
+    // Keys view into names; deque elements never move.
+    std::unordered_map<std::string_view, uint32_t> ids;
+    std::deque<std::string> names;
+};
+
+#endif // TOPIC_INTERNER_H
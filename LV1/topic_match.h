@@ -0,0 +1,48 @@
+#ifndef TOPIC_MATCH_H
+#define TOPIC_MATCH_H
+
+#include <cstddef>
+#include <string_view>
+
+// Topic names are '/'-separated levels. A subscription filter may use '+'
+// for exactly one level and a trailing '#' for any number of remaining
+// levels (including none), as in MQTT. Names starting with '$' are not
+// matched by a leading wildcard.
+inline bool valid_topic_filter(std::string_view filter) {
+    if (filter.empty()) return false;
+    size_t pos = 0;
+    while (true) {
+        size_t end = filter.find('/', pos);
+        std::string_view level = filter.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+        if (level.find_first_of("+#") != std::string_view::npos && level.size() != 1) return false;
+        if (level == "#" && end != std::string_view::npos) return false;
+        if (end == std::string_view::npos) return true;
+        pos = end + 1;
+    }
+}
+
+inline bool valid_topic_name(std::string_view topic) {
+    return !topic.empty() && topic.find_first_of("+#") == std::string_view::npos;
+}
+
+// Whether filter matches the topic name, by the rules above.
+inline bool topic_matches(std::string_view filter, std::string_view topic) {
+    if (!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#')) return false;
+    size_t f = 0, t = 0;
+    while (true) {
+        size_t f_end = filter.find('/', f);
+        std::string_view level = filter.substr(f, f_end == std::string_view::npos ? std::string_view::npos : f_end - f);
+        if (level == "#") return true;
+        if (t == std::string_view::npos) return false;
+
+        size_t t_end = topic.find('/', t);
+        if (level != "+" && level != topic.substr(t, t_end == std::string_view::npos ? std::string_view::npos : t_end - t)) {
+            return false;
+        }
+        t = t_end == std::string_view::npos ? std::string_view::npos : t_end + 1;
+        if (f_end == std::string_view::npos) return t == std::string_view::npos;
+        f = f_end + 1;
+    }
+}
+
+#endif // TOPIC_MATCH_H
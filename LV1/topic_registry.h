@@ -0,0 +1,499 @@
+#ifndef TOPIC_REGISTRY_H
+#define TOPIC_REGISTRY_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "content_filter.h"
+#include "outbound_queue.h"
+#include "topic_match.h"
+
+struct Connection;
+using ConnectionPtr = std::shared_ptr<Connection>;
+
+// Immutable subscriber list of one topic filter. Publishers keep a snapshot
+// alive for as long as they fan out; writers never modify a published
+// snapshot, they drop it and the next publisher builds a fresh one.
+using Subscribers = std::vector<ConnectionPtr>;
+using SubscriberSnapshot = std::shared_ptr<const Subscribers>;
+
+// How a consumer group picks the member that gets the next message.
+enum class GroupBalance { Unset, RoundRobin, LeastQueued };
+
+inline const char *group_balance_name(GroupBalance balance) {
+    return balance == GroupBalance::LeastQueued ? "least-queued" : "round-robin";
+}
+
+inline bool parse_group_balance(std::string_view name, GroupBalance &balance) {
+    if (name == "round-robin") balance = GroupBalance::RoundRobin;
+    else if (name == "least-queued") balance = GroupBalance::LeastQueued;
+    else return false;
+    return true;
+}
+
+// Shared by a consumer group's publishers: the balance last asked for, and
+// where the next round-robin pick starts.
+struct GroupState {
+    std::atomic<GroupBalance> balance{GroupBalance::Unset};
+    std::atomic<size_t> next{0};
+};
+
+// A consumer group of a matching filter, as a publisher sees it: each
+// message goes to one of its members.
+struct GroupView {
+    SubscriberSnapshot members;
+    std::shared_ptr<GroupState> state;
+};
+
+// Subscribers of a matching filter that share a WHERE condition, which the
+// publisher checks once for all of them.
+struct SelectionView {
+    SubscriberSnapshot members;
+    ContentFilterPtr condition;
+};
+
+// What a publisher needs to know about a topic to fan out to it: the
+// subscriber snapshot of every filter that matches, the consumer groups and
+// conditional subscribers of those filters, plus the topic's own settings.
+struct TopicView {
+    std::vector<SubscriberSnapshot> matches;
+    std::vector<GroupView> groups;
+    std::vector<SelectionView> selections;
+    OverflowPolicy policy = OverflowPolicy::Unset;
+    bool conflate = false;
+
+    bool empty() const {
+        for (const auto &snap : matches) {
+            if (!snap->empty()) return false;
+        }
+        return groups.empty() && selections.empty();
+    }
+
+    // Visits every subscriber that wants message once, even if several of
+    // its filters match: the plain ones, and those whose condition holds.
+    // Group members are the caller's to pick from.
+    template <typename F>
+    void for_each_subscriber(std::string_view message, F &&fn) const {
+        if (matches.size() == 1 && selections.empty()) {
+            for (const ConnectionPtr &sub : *matches[0]) fn(sub);
+            return;
+        }
+        std::unordered_set<const Connection *> seen;
+        for (const auto &snap : matches) {
+            for (const ConnectionPtr &sub : *snap) {
+                if (seen.insert(sub.get()).second) fn(sub);
+            }
+        }
+        for (const SelectionView &selection : selections) {
+            if (!selection.condition->matches(message)) continue;
+            for (const ConnectionPtr &sub : *selection.members) {
+                if (seen.insert(sub.get()).second) fn(sub);
+            }
+        }
+    }
+};
+
+// Topic filter -> subscribers, stored as a trie of topic levels so a
+// PUBLISH finds every matching filter in O(depth) without scanning them.
+//
+// Reads are copy-on-write (RCU-style): a publisher takes the trie lock in
+// shared mode only long enough to collect the matching snapshots, then fans
+// out with no lock held. Writers on the same filter are serialised by a
+// per-filter mutex, so SUBSCRIBE/UNSUBSCRIBE on different filters never
+// contend with each other; the trie lock is only taken exclusively to add
+// a new level.
+//
+// Subscribing and unsubscribing are O(1): each filter keeps its members in
+// a vector with every member's position indexed, removes by swapping the
+// last member into the hole, and only invalidates the published snapshot.
+// The snapshot is rebuilt lazily by the next publisher, so a burst of
+// (un)subscribes -- a reconnect storm -- costs one copy, not one per change.
+//
+// A filter's consumer groups, and its subscribers with a WHERE condition
+// (one set per distinct condition), keep their members the same way, next
+// to its plain subscribers and under the same write mutex. Such a subset
+// lives as long as it has members, and a filter as long as it has members,
+// subsets or settings: the last one out erases it and prunes the trie
+// levels nothing else hangs off.
+class TopicRegistry {
+    struct Entry;
+    struct Subset;
+    struct Subsets;
+
+public:
+    // A connection's membership of one filter, or of one of its subsets.
+    // Holding it lets the owner unsubscribe, or tear down, without looking
+    // the filter up again.
+    class Subscription {
+        friend class TopicRegistry;
+        std::shared_ptr<Entry> entry;
+        std::shared_ptr<Subset> subset;
+        // Which of the entry's subset lists it is in.
+        Subsets Entry::*list = nullptr;
+    };
+
+    TopicView match(std::string_view topic) const {
+        TopicView view;
+        std::shared_lock<std::shared_mutex> lock(trie_mutex);
+        collect(root, topic, 0, true, view);
+        if (const Node *node = find_node(topic)) {
+            if (node->entry) {
+                view.policy = node->entry->policy.load(std::memory_order_relaxed);
+                view.conflate = node->entry->conflate.load(std::memory_order_relaxed);
+            }
+        }
+        return view;
+    }
+
+    void set_policy(const std::string &topic, OverflowPolicy policy) {
+        std::unique_lock<std::mutex> lock;
+        std::shared_ptr<Entry> entry = find_live(topic, lock);
+        entry->policy.store(policy, std::memory_order_relaxed);
+        lock.unlock();
+        if (policy == OverflowPolicy::Unset) prune(topic, entry);
+    }
+
+    void set_conflate(const std::string &topic, bool conflate) {
+        std::unique_lock<std::mutex> lock;
+        std::shared_ptr<Entry> entry = find_live(topic, lock);
+        entry->conflate.store(conflate, std::memory_order_relaxed);
+        lock.unlock();
+        if (!conflate) prune(topic, entry);
+    }
+
+    // Adding a connection that is already subscribed changes nothing. With
+    // a group name the connection joins that consumer group of the filter
+    // instead, and sets the group's balance unless it is Unset.
+    Subscription add(const std::string &filter, const ConnectionPtr &conn, const std::string &group = {},
+                     GroupBalance balance = GroupBalance::Unset) {
+        Subscription sub;
+        std::unique_lock<std::mutex> lock;
+        sub.entry = find_live(filter, lock);
+        Entry &entry = *sub.entry;
+        if (group.empty()) {
+            entry.members.add(conn);
+            return sub;
+        }
+        join(sub, &Entry::groups, group, conn);
+        if (balance != GroupBalance::Unset) sub.subset->state->balance.store(balance, std::memory_order_relaxed);
+        return sub;
+    }
+
+    // Subscribes the connection to the messages of filter that condition
+    // holds for. Subscribers with the same condition share its first
+    // compiled copy.
+    Subscription add(const std::string &filter, const ConnectionPtr &conn, const ContentFilterPtr &condition) {
+        Subscription sub;
+        std::unique_lock<std::mutex> lock;
+        sub.entry = find_live(filter, lock);
+        join(sub, &Entry::selections, condition->text(), conn);
+        if (!sub.subset->condition) sub.subset->condition = condition;
+        return sub;
+    }
+
+    // Returns false if the connection was not subscribed. filter is the one
+    // sub was made for.
+    bool remove(std::string_view filter, const Subscription &sub, const ConnectionPtr &conn) {
+        if (!sub.entry) return false;
+        Entry &entry = *sub.entry;
+        {
+            std::lock_guard<std::mutex> lock(entry.write_mutex);
+            if (!sub.subset) {
+                if (!entry.members.remove(conn)) return false;
+            } else {
+                if (!sub.subset->members.remove(conn)) return false;
+                if (sub.subset->members.list.empty()) {
+                    Subsets &list = entry.*sub.list;
+                    list.by_name.erase(sub.subset->name);
+                    std::atomic_store(&list.snapshot, SubsetsSnapshot());
+                }
+            }
+            if (!entry.unused()) return true;
+        }
+        prune(filter, sub.entry);
+        return true;
+    }
+
+    // Same, for a caller that does not hold the Subscription; group or
+    // condition (its canonical text) name the subset, if any.
+    bool remove(std::string_view filter, const ConnectionPtr &conn, std::string_view group = {},
+                std::string_view condition = {}) {
+        Subscription sub;
+        sub.entry = find(filter);
+        if (sub.entry && (!group.empty() || !condition.empty())) {
+            sub.list = group.empty() ? &Entry::selections : &Entry::groups;
+            std::lock_guard<std::mutex> lock(sub.entry->write_mutex);
+            const Subsets &list = (*sub.entry).*sub.list;
+            auto it = list.by_name.find(group.empty() ? condition : group);
+            if (it == list.by_name.end()) return false;
+            sub.subset = it->second;
+        }
+        return remove(filter, sub, conn);
+    }
+
+    // Every filter that currently has subscribers or settings.
+    std::vector<std::string> topic_names() const {
+        std::shared_lock<std::shared_mutex> lock(trie_mutex);
+        std::vector<std::string> names;
+        for (const auto &kv : root.children) list_names(*kv.second, kv.first, names);
+        return names;
+    }
+
+private:
+    // Guarded by the write mutex of the entry they belong to.
+    struct Members {
+        // Current members, unordered; index holds each one's position.
+        Subscribers list;
+        std::unordered_map<const Connection *, size_t> index;
+        // Published copy of list, or null if it changed since.
+        SubscriberSnapshot snapshot = std::make_shared<const Subscribers>();
+
+        void add(const ConnectionPtr &conn) {
+            if (!index.emplace(conn.get(), list.size()).second) return;
+            list.push_back(conn);
+            std::atomic_store(&snapshot, SubscriberSnapshot());
+        }
+
+        bool remove(const ConnectionPtr &conn) {
+            auto it = index.find(conn.get());
+            if (it == index.end()) return false;
+
+            size_t pos = it->second;
+            index.erase(it);
+            if (pos + 1 != list.size()) {
+                list[pos] = std::move(list.back());
+                index[list[pos].get()] = pos;
+            }
+            list.pop_back();
+            std::atomic_store(&snapshot, SubscriberSnapshot());
+            return true;
+        }
+    };
+
+    // A consumer group, by its name, or the subscribers sharing a
+    // condition, by its canonical text.
+    struct Subset {
+        explicit Subset(std::string name) : name(std::move(name)) {}
+
+        const std::string name;
+        Members members;
+        // Groups only.
+        std::shared_ptr<GroupState> state = std::make_shared<GroupState>();
+        // Conditional subscribers only; set once, before it is published.
+        ContentFilterPtr condition;
+    };
+
+    using SubsetsSnapshot = std::shared_ptr<const std::vector<std::shared_ptr<Subset>>>;
+
+    struct Subsets {
+        std::map<std::string, std::shared_ptr<Subset>, std::less<>> by_name;
+        // Published copy of the subsets, or null if one came or went.
+        SubsetsSnapshot snapshot = std::make_shared<const std::vector<std::shared_ptr<Subset>>>();
+    };
+
+    struct Entry {
+        std::mutex write_mutex;
+        Members members;
+        Subsets groups;
+        Subsets selections;
+        std::atomic<OverflowPolicy> policy{OverflowPolicy::Unset};
+        std::atomic<bool> conflate{false};
+        // Set once the entry has been erased from the trie; whoever still
+        // holds it looks the filter up again. Guarded by write_mutex.
+        bool retired = false;
+
+        // Caller holds write_mutex.
+        bool unused() const {
+            return members.list.empty() && groups.by_name.empty() && selections.by_name.empty() &&
+                   policy.load(std::memory_order_relaxed) == OverflowPolicy::Unset &&
+                   !conflate.load(std::memory_order_relaxed);
+        }
+    };
+
+    // Caller holds the entry's write mutex.
+    static void join(Subscription &sub, Subsets Entry::*list, const std::string &name, const ConnectionPtr &conn) {
+        Subsets &subsets = (*sub.entry).*list;
+        std::shared_ptr<Subset> &subset = subsets.by_name[name];
+        if (!subset) {
+            subset = std::make_shared<Subset>(name);
+            std::atomic_store(&subsets.snapshot, SubsetsSnapshot());
+        }
+        subset->members.add(conn);
+        sub.subset = subset;
+        sub.list = list;
+    }
+
+    struct Node {
+        std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+        std::shared_ptr<Entry> entry;
+    };
+
+    static SubscriberSnapshot snapshot_of(Entry &entry, Members &members) {
+        if (SubscriberSnapshot snap = std::atomic_load(&members.snapshot)) return snap;
+
+        std::lock_guard<std::mutex> lock(entry.write_mutex);
+        SubscriberSnapshot snap = std::atomic_load(&members.snapshot);
+        if (!snap) {
+            snap = std::make_shared<const Subscribers>(members.list);
+            std::atomic_store(&members.snapshot, snap);
+        }
+        return snap;
+    }
+
+    static SubsetsSnapshot snapshot_of(Entry &entry, Subsets &subsets) {
+        if (SubsetsSnapshot snap = std::atomic_load(&subsets.snapshot)) return snap;
+
+        std::lock_guard<std::mutex> lock(entry.write_mutex);
+        SubsetsSnapshot snap = std::atomic_load(&subsets.snapshot);
+        if (!snap) {
+            auto list = std::make_shared<std::vector<std::shared_ptr<Subset>>>();
+            for (const auto &kv : subsets.by_name) list->push_back(kv.second);
+            snap = std::move(list);
+            std::atomic_store(&subsets.snapshot, snap);
+        }
+        return snap;
+    }
+
+    static void add_match(const Node &node, TopicView &view) {
+        if (!node.entry) return;
+        Entry &entry = *node.entry;
+        view.matches.push_back(snapshot_of(entry, entry.members));
+        for (const std::shared_ptr<Subset> &group : *snapshot_of(entry, entry.groups)) {
+            view.groups.push_back({snapshot_of(entry, group->members), group->state});
+        }
+        for (const std::shared_ptr<Subset> &selection : *snapshot_of(entry, entry.selections)) {
+            view.selections.push_back({snapshot_of(entry, selection->members), selection->condition});
+        }
+    }
+
+    // pos is the start of the next level of topic, or npos once every level
+    // has been consumed.
+    static void collect(const Node &node, std::string_view topic, size_t pos, bool top, TopicView &view) {
+        bool system = top && !topic.empty() && topic[0] == '$';
+
+        if (!system) {
+            auto hash = node.children.find("#");
+            if (hash != node.children.end()) add_match(*hash->second, view);
+        }
+        if (pos == std::string_view::npos) {
+            add_match(node, view);
+            return;
+        }
+
+        size_t end = topic.find('/', pos);
+        std::string_view level = topic.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+        size_t next = end == std::string_view::npos ? std::string_view::npos : end + 1;
+
+        auto exact = node.children.find(level);
+        if (exact != node.children.end()) collect(*exact->second, topic, next, false, view);
+        if (!system) {
+            auto plus = node.children.find("+");
+            if (plus != node.children.end()) collect(*plus->second, topic, next, false, view);
+        }
+    }
+
+    static void list_names(const Node &node, const std::string &path, std::vector<std::string> &names) {
+        if (node.entry) names.push_back(path);
+        for (const auto &kv : node.children) list_names(*kv.second, path + "/" + kv.first, names);
+    }
+
+    // Caller holds trie_mutex.
+    const Node *find_node(std::string_view filter) const {
+        const Node *node = &root;
+        size_t pos = 0;
+        while (true) {
+            size_t end = filter.find('/', pos);
+            std::string_view level = filter.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+            auto it = node->children.find(level);
+            if (it == node->children.end()) return nullptr;
+            node = it->second.get();
+            if (end == std::string_view::npos) return node;
+            pos = end + 1;
+        }
+    }
+
+    std::shared_ptr<Entry> find(std::string_view filter) const {
+        std::shared_lock<std::shared_mutex> lock(trie_mutex);
+        const Node *node = find_node(filter);
+        return node ? node->entry : nullptr;
+    }
+
+    std::shared_ptr<Entry> find_or_create(std::string_view filter) {
+        if (std::shared_ptr<Entry> entry = find(filter)) return entry;
+
+        std::unique_lock<std::shared_mutex> lock(trie_mutex);
+        Node *node = &root;
+        size_t pos = 0;
+        while (true) {
+            size_t end = filter.find('/', pos);
+            std::string_view level = filter.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+            auto it = node->children.find(level);
+            if (it == node->children.end()) {
+                it = node->children.emplace(std::string(level), std::make_unique<Node>()).first;
+            }
+            node = it->second.get();
+            if (end == std::string_view::npos) break;
+            pos = end + 1;
+        }
+        if (!node->entry) node->entry = std::make_shared<Entry>();
+        return node->entry;
+    }
+
+    // The filter's entry, with its write mutex held in lock, that is still
+    // in the trie: one pruned meanwhile is looked up (or created) again.
+    std::shared_ptr<Entry> find_live(std::string_view filter, std::unique_lock<std::mutex> &lock) {
+        while (true) {
+            std::shared_ptr<Entry> entry = find_or_create(filter);
+            lock = std::unique_lock<std::mutex>(entry->write_mutex);
+            if (!entry->retired) return entry;
+            lock.unlock();
+        }
+    }
+
+    // Erases the filter's entry if it is still the given one and still
+    // unused, then every level on its path that no longer leads anywhere.
+    // Publishers that already took the entry's snapshots keep them.
+    void prune(std::string_view filter, const std::shared_ptr<Entry> &entry) {
+        std::unique_lock<std::shared_mutex> trie_lock(trie_mutex);
+        std::vector<std::pair<Node *, std::string_view>> path;
+        Node *node = &root;
+        size_t pos = 0;
+        while (true) {
+            size_t end = filter.find('/', pos);
+            std::string_view level = filter.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+            auto it = node->children.find(level);
+            if (it == node->children.end()) return;
+            path.emplace_back(node, level);
+            node = it->second.get();
+            if (end == std::string_view::npos) break;
+            pos = end + 1;
+        }
+        if (node->entry != entry) return;
+        {
+            std::lock_guard<std::mutex> lock(entry->write_mutex);
+            if (!entry->unused()) return;
+            entry->retired = true;
+        }
+        node->entry.reset();
+
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            auto child = it->first->children.find(it->second);
+            if (child->second->entry || !child->second->children.empty()) break;
+            it->first->children.erase(child);
+        }
+    }
+
+    mutable std::shared_mutex trie_mutex;
+    Node root;
+};
+
+#endif // TOPIC_REGISTRY_H
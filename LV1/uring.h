@@ -0,0 +1,303 @@
+#ifndef URING_H
+#define URING_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Just enough io_uring for the broker, on the raw system calls: one
+// submission and completion ring, and a pool of provided buffers that
+// multishot receives fill. Not thread-safe; every shard has its own.
+//
+// Submissions are only queued until the next wait(), so everything a shard
+// does in one pass -- a fan-out to thousands of sockets included -- costs
+// one io_uring_enter.
+class Uring {
+public:
+    Uring() = default;
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    ~Uring() {
+        if (buf_base) munmap(buf_base, (size_t)buf_count * buf_size);
+        if (sq_ptr) munmap(sq_ptr, sq_size);
+        if (cq_ptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sqes) munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+        if (fd >= 0) close(fd);
+    }
+
+    // False, with errno set, if the kernel has no io_uring or lacks a
+    // feature used here. The ring may only be used from the thread that
+    // created it.
+    bool init(unsigned entries) {
+        io_uring_params p{};
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        p.cq_entries = entries * 4;
+        fd = enter_setup(entries, p);
+        if (fd < 0 && errno == EINVAL) {
+            // Kernels before 6.1: plain task running will do.
+            p = io_uring_params{};
+            p.flags = IORING_SETUP_CQSIZE;
+            p.cq_entries = entries * 4;
+            fd = enter_setup(entries, p);
+        }
+        if (fd < 0) return false;
+        unsigned needed = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP | IORING_FEAT_CQE_SKIP;
+        if ((p.features & needed) != needed) {
+            errno = ENOSYS;
+            return false;
+        }
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+        sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+        if (!sq_ptr) return false;
+        cq_ptr = single ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+        if (!cq_ptr) return false;
+        sq_entries = p.sq_entries;
+        sqes = static_cast<io_uring_sqe *>(map(sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+        if (!sqes) return false;
+
+        char *sq = static_cast<char *>(sq_ptr);
+        char *cq = static_cast<char *>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_ktail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        unsigned *array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++) array[i] = i;
+        cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        sq_tail = *sq_ktail;
+        return true;
+    }
+
+    // Hands the kernel count buffers of size bytes as buffer group `group`,
+    // for receives that select their own buffer.
+    //
+    // These are the classic provided buffers, given back one submission at
+    // a time, rather than a mapped buffer ring: some kernels accept the
+    // ring's registration and then never take a buffer from it.
+    bool setup_buffers(uint16_t group, unsigned count, unsigned size) {
+        void *base = mmap(nullptr, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) return false;
+        buf_base = static_cast<char *>(base);
+        buf_count = count;
+        buf_size = size;
+        buf_group = group;
+
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe) return false;
+        provide(sqe, 0, count);
+        sqe->user_data = INTERNAL;
+        enter(1, 0);
+        bool ok = false;
+        for_each_cqe([&](const io_uring_cqe &cqe) {
+            if (cqe.user_data == INTERNAL) ok = cqe.res >= 0;
+        });
+        return ok;
+    }
+
+    char *buffer(uint16_t bid) const { return buf_base + (size_t)bid * buf_size; }
+
+    // Hands a buffer back to the kernel once its data has been copied out;
+    // goes in with the next submission and, unless it fails, completes
+    // without a trace.
+    void recycle(uint16_t bid) {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe) return;
+        provide(sqe, bid, 1);
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = INTERNAL;
+    }
+
+    // A zeroed submission entry; submits the queued ones first if the
+    // ring is full.
+    io_uring_sqe *get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sq_tail - head >= sq_entries) {
+            enter(0, 0);
+            head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (sq_tail - head >= sq_entries) return nullptr;
+        }
+        io_uring_sqe *sqe = &sqes[sq_tail & sq_mask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_tail++;
+        return sqe;
+    }
+
+    // Accepts every incoming connection until cancelled.
+    bool accept_multishot(int listen_fd, uint64_t user_data) {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    // Completes every time fd becomes readable.
+    bool poll_multishot(int fd_, uint64_t user_data) {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd_;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    // Completes with every chunk received, each in a buffer of `group`.
+    bool recv_multishot(int fd_, uint16_t group, uint64_t user_data) {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd_;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = group;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    // msg must stay valid until the completion.
+    bool sendmsg(int fd_, const msghdr *msg, uint64_t user_data) {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd_;
+        sqe->addr = reinterpret_cast<uint64_t>(msg);
+        sqe->len = 1;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    // Submits everything queued, then waits for a completion: not at all
+    // with timeout_ms 0, without limit with timeout_ms < 0.
+    void wait(int timeout_ms) {
+        if (timeout_ms == 0) {
+            enter(0, 0);
+            return;
+        }
+        if (timeout_ms < 0) {
+            enter(1, 0);
+            return;
+        }
+        __kernel_timespec ts{timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+        io_uring_getevents_arg arg{};
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        enter(1, IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    // Calls fn on every completion that has come in, and frees their slots.
+    template <typename F>
+    void for_each_completion(F &&fn) {
+        for_each_cqe([&](const io_uring_cqe &cqe) {
+            if (cqe.user_data != INTERNAL) fn(cqe);
+        });
+    }
+
+    // Whether this kernel runs everything the broker asks of io_uring:
+    // tries a multishot receive into a provided buffer on a socket pair.
+    static bool probe() {
+        Uring ring;
+        if (!ring.init(8) || !ring.setup_buffers(0, 2, 64)) return false;
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) return false;
+        bool ok = false;
+        if (ring.recv_multishot(pair[0], 0, 1) && write(pair[1], "x", 1) == 1) {
+            ring.wait(1000);
+            ring.for_each_completion([&](const io_uring_cqe &cqe) {
+                ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER) && (cqe.flags & IORING_CQE_F_MORE);
+            });
+        }
+        close(pair[0]);
+        close(pair[1]);
+        return ok;
+    }
+
+private:
+    // Completions of the ring's own bookkeeping, never shown to callers.
+    static constexpr uint64_t INTERNAL = ~(uint64_t)0;
+
+    template <typename F>
+    void for_each_cqe(F &&fn) {
+        unsigned head = *cq_head;
+        while (true) {
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) break;
+            while (head != tail) {
+                io_uring_cqe cqe = cqes[head & cq_mask];
+                head++;
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+                fn(cqe);
+            }
+        }
+    }
+
+    static int enter_setup(unsigned entries, io_uring_params &p) {
+        return (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+
+    void *map(size_t size, off_t offset) {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    void enter(unsigned min_complete, unsigned flags, void *arg = nullptr, size_t arg_size = 0) {
+        __atomic_store_n(sq_ktail, sq_tail, __ATOMIC_RELEASE);
+        unsigned pending = sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        // A timeout or a signal just ends the wait.
+        while (syscall(__NR_io_uring_enter, fd, pending, min_complete, flags | IORING_ENTER_GETEVENTS, arg, arg_size) < 0 &&
+               errno == EINTR) {
+        }
+    }
+
+    void provide(io_uring_sqe *sqe, uint16_t bid, unsigned count) {
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = (int)count;
+        sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+        sqe->len = buf_size;
+        sqe->off = bid;
+        sqe->buf_group = buf_group;
+    }
+
+    int fd = -1;
+    void *sq_ptr = nullptr;
+    void *cq_ptr = nullptr;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned sq_entries = 0;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_ktail = nullptr;
+    unsigned sq_mask = 0;
+    // Local tail, handed to the kernel on the next enter.
+    unsigned sq_tail = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    char *buf_base = nullptr;
+    unsigned buf_count = 0;
+    unsigned buf_size = 0;
+    uint16_t buf_group = 0;
+};
+
+#endif // URING_H
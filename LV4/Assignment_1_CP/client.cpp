@@ -83,20 +83,20 @@ void runBenchmark(int clientSocket, int numOperations) {
   for (int i = 0; i < numOperations; i++) {
     Message msg;
     msg.cmd = CMD_SET;
-    snprintf(msg.key, MAX_KEY_SIZE, "benchmark_key_%d", i);
-    snprintf(msg.value, MAX_VALUE_SIZE, "benchmark_value_%d", i);
+    msg.key = "benchmark_key_" + std::to_string(i);
+    msg.value = "benchmark_value_" + std::to_string(i);
 
     auto start = std::chrono::high_resolution_clock::now();
 
     // Send message
-    if (send(clientSocket, (char *)&msg, sizeof(Message), 0) == -1) {
+    if (!sendMessage(clientSocket, msg)) {
       std::cout << "Failed to send message " << i << std::endl;
       continue;
     }
 
     // Receive response
     Message response;
-    if (recv(clientSocket, (char *)&response, sizeof(Message), 0) <= 0) {
+    if (!recvMessage(clientSocket, response)) {
       std::cout << "Failed to receive response " << i << std::endl;
       break;
     }
@@ -194,20 +194,20 @@ int main(int argc, char *argv[]) {
       std::getline(iss >> std::ws, value);
 
       msg.cmd = CMD_SET;
-      strncpy(msg.key, key.c_str(), MAX_KEY_SIZE - 1);
-      strncpy(msg.value, value.c_str(), MAX_VALUE_SIZE - 1);
+      msg.key = key.substr(0, MAX_KEY_SIZE);
+      msg.value = value;
 
     } else if (command == "GET") {
       std::string key;
       iss >> key;
       msg.cmd = CMD_GET;
-      strncpy(msg.key, key.c_str(), MAX_KEY_SIZE - 1);
+      msg.key = key.substr(0, MAX_KEY_SIZE);
 
     } else if (command == "DELETE") {
       std::string key;
       iss >> key;
       msg.cmd = CMD_DELETE;
-      strncpy(msg.key, key.c_str(), MAX_KEY_SIZE - 1);
+      msg.key = key.substr(0, MAX_KEY_SIZE);
 
     } else if (command == "LIST") {
       msg.cmd = CMD_LIST;
@@ -221,14 +221,18 @@ int main(int argc, char *argv[]) {
     auto start = std::chrono::high_resolution_clock::now();
 
     // Send message to leader
-    if (send(clientSocket, (char *)&msg, sizeof(Message), 0) == -1) {
+    if (!sendMessage(clientSocket, msg)) {
+      if (errno == EMSGSIZE) {
+        std::cout << "[ERROR] Message too large to send" << std::endl;
+        continue;
+      }
       perror("Failed to send message");
       break;
     }
 
     // Receive response
     Message response;
-    if (recv(clientSocket, (char *)&response, sizeof(Message), 0) <= 0) {
+    if (!recvMessage(clientSocket, response)) {
       std::cout << "Connection lost" << std::endl;
       break;
     }
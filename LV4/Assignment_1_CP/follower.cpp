@@ -1,16 +1,22 @@
+#include "../../common/async_logger.h"
 #include "kv_store.h"
 #include <arpa/inet.h>
+#include <chrono>
 #include <csignal>
 #include <iostream>
+#include <map>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
 KeyValueStore store;
 int followerId = 0;
 
-// Send ACK back to leader
+// Send a cumulative ACK back to leader: everything through sequence is applied
 void sendAck(int leaderSocket, uint64_t sequence) {
   Message ack;
   ack.cmd = CMD_ACK;
@@ -18,59 +24,111 @@ void sendAck(int leaderSocket, uint64_t sequence) {
   ack.followerId = followerId;
   ack.status = 0;
 
-  if (send(leaderSocket, (char *)&ack, sizeof(Message), 0) == -1) {
+  if (!sendMessage(leaderSocket, ack)) {
     perror("Failed to send ACK");
   } else {
-    std::cout << "[FOLLOWER " << followerId << "] Sent ACK for seq " << sequence
-              << std::endl;
+    LOG_DEBUG("[FOLLOWER " << followerId << "] Sent ACK through seq "
+              << sequence);
+  }
+}
+
+// Whether more of the leader's stream is already waiting to be read
+bool inputPending(int leaderSocket) {
+  int bytes = 0;
+  return ioctl(leaderSocket, FIONREAD, &bytes) == 0 && bytes > 0;
+}
+
+// Apply a replicated write locally
+void apply(const Message &msg) {
+  if (msg.cmd == CMD_SET) {
+    store.set(msg.key, msg.value);
+    LOG_DEBUG("[FOLLOWER " << followerId << "] Applied SET " << msg.key
+              << " = " << msg.value << " (seq: " << msg.sequence << ")");
+  } else {
+    store.deleteKey(msg.key);
+    LOG_DEBUG("[FOLLOWER " << followerId << "] Applied DELETE " << msg.key
+              << " (seq: " << msg.sequence << ")");
   }
 }
 
 // Listen for replication updates from leader
+//
+// The leader keeps many writes in flight, alone or in CMD_BATCH frames.
+// They are applied strictly in sequence order: one that arrives ahead of a
+// gap waits until the gap is filled. Rather than one ACK per write, a single
+// cumulative ACK goes back once the input read so far has been handled, so
+// at most one per batch. Under a steady stream the input is rarely drained,
+// so an ACK also goes out every ACK_EVERY_WRITES writes or ACK_DEFER_US
+// microseconds, whichever comes first.
 void listenForUpdates(int leaderSocket) {
   Message msg;
+  std::vector<Message> writes;
+  uint64_t appliedThrough = 0;
+  uint64_t ackedThrough = 0;
+  auto ackedAt = std::chrono::steady_clock::now();
+  std::map<uint64_t, Message> waiting; // Arrived ahead of a gap
 
-  std::cout << "[FOLLOWER " << followerId
-            << "] Connected to leader, waiting for updates..." << std::endl;
-  std::cout << std::endl;
+  LOG_INFO("[FOLLOWER " << followerId
+           << "] Connected to leader, waiting for updates...");
 
   while (true) {
     // Receive replication message from leader
-    int bytesReceived = recv(leaderSocket, (char *)&msg, sizeof(Message), 0);
-
-    if (bytesReceived <= 0) {
-      std::cout << "[FOLLOWER " << followerId << "] Lost connection to leader"
-                << std::endl;
+    if (!recvMessage(leaderSocket, msg)) {
+      LOG_WARN("[FOLLOWER " << followerId << "] Lost connection to leader");
       break;
     }
 
-    // Apply the operation locally
-    std::string key(msg.key);
-    std::string value(msg.value);
-
-    if (msg.cmd == CMD_SET) {
-      store.set(key, value);
-      std::cout << "[FOLLOWER " << followerId << "] Applied SET " << key
-                << " = " << value << " (seq: " << msg.sequence << ")"
-                << std::endl;
-
-      // Send ACK back to leader
-      sendAck(leaderSocket, msg.sequence);
-
-    } else if (msg.cmd == CMD_DELETE) {
-      store.deleteKey(key);
-      std::cout << "[FOLLOWER " << followerId << "] Applied DELETE " << key
-                << " (seq: " << msg.sequence << ")" << std::endl;
+    if (msg.cmd == CMD_SYNC) {
+      // Sent once on registration: our stream starts after this sequence
+      appliedThrough = ackedThrough = msg.sequence;
+      LOG_DEBUG("[FOLLOWER " << followerId << "] Starting after seq "
+                << msg.sequence);
+
+    } else if (msg.cmd == CMD_SET || msg.cmd == CMD_DELETE ||
+               msg.cmd == CMD_BATCH) {
+      writes.clear();
+      if (msg.cmd != CMD_BATCH) {
+        writes.push_back(std::move(msg));
+      } else if (!decodeBatch(msg, writes)) {
+        LOG_WARN("[FOLLOWER " << followerId << "] Malformed batch at seq "
+                 << msg.sequence);
+        break;
+      }
 
-      // Send ACK back to leader
-      sendAck(leaderSocket, msg.sequence);
+      // Apply the operations locally, along with any they unblock
+      for (Message &write : writes) {
+        if (write.sequence == appliedThrough + 1) {
+          apply(write);
+          appliedThrough++;
+        } else if (write.sequence > appliedThrough) {
+          waiting.emplace(write.sequence, std::move(write));
+        }
+      }
+      while (!waiting.empty() &&
+             waiting.begin()->first == appliedThrough + 1) {
+        apply(waiting.begin()->second);
+        waiting.erase(waiting.begin());
+        appliedThrough++;
+      }
 
     } else if (msg.cmd == CMD_LIST) {
-      std::cout << "[FOLLOWER " << followerId << "] Current data:" << std::endl;
+      LOG_DEBUG("[FOLLOWER " << followerId << "] Current data:");
       const std::unordered_map<std::string, std::string> data =
           store.getAllData();
       for (auto const &[k, v] : data) {
-        std::cout << "  " << k << " = " << v << std::endl;
+        LOG_DEBUG("  " << k << " = " << v);
+      }
+    }
+
+    // Send ACK back to leader
+    if (appliedThrough > ackedThrough) {
+      auto now = std::chrono::steady_clock::now();
+      if (appliedThrough - ackedThrough >= ACK_EVERY_WRITES ||
+          now - ackedAt >= std::chrono::microseconds(ACK_DEFER_US) ||
+          !inputPending(leaderSocket)) {
+        sendAck(leaderSocket, appliedThrough);
+        ackedThrough = appliedThrough;
+        ackedAt = now;
       }
     }
   }
@@ -110,17 +168,20 @@ int main(int argc, char *argv[]) {
       connected = true;
       break;
     }
-    std::cout << "[FOLLOWER " << followerId << "] Waiting for leader (attempt "
-              << (i + 1) << "/10)..." << std::endl;
+    LOG_INFO("[FOLLOWER " << followerId << "] Waiting for leader (attempt "
+             << (i + 1) << "/10)...");
     sleep(1);
   }
 
   if (!connected) {
-    std::cout << "[FOLLOWER " << followerId << "] Could not connect to leader"
-              << std::endl;
+    LOG_WARN("[FOLLOWER " << followerId << "] Could not connect to leader");
     return 1;
   }
 
+  // ACKs are small and must not wait for the previous one to be acknowledged
+  int noDelay = 1;
+  setsockopt(regSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
   // Start listening for updates
   listenForUpdates(regSocket);
 
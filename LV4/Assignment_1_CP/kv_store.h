@@ -1,16 +1,24 @@
 #ifndef KV_STORE_H
 #define KV_STORE_H
 
+#include <cerrno>
 #include <chrono>
+#include <cstdint>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <sys/socket.h>
 #include <unordered_map>
+#include <vector>
 
 // Maximum sizes for protocol messages
 #define MAX_KEY_SIZE 256
-#define MAX_VALUE_SIZE 4096
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
 #define MAX_SOCKET_PATH 256
+#define STORE_SHARDS 64 // Lock stripes of the key-value store
 
 // CP System Configuration
 #define ACK_TIMEOUT_MS 5000 // Timeout waiting for follower ACKs (5 seconds)
@@ -18,49 +26,275 @@
   true // If true, require ALL followers to ACK (strict CP)
        // If false, require majority (quorum-based CP)
 
+// Group commit: concurrent writes are replicated in batches
+#define BATCH_WINDOW_US 50      // How long a batch waits for more writes
+#define MAX_BATCH_WRITES 1024   // A batch closes once it has this many...
+#define MAX_BATCH_BYTES 1048576 // ...or this many bytes of keys and values
+#define PENDING_SLOTS 4096      // Batches in flight at most
+
+// A follower defers its cumulative ACK while more of the stream is waiting,
+// but no longer than this
+#define ACK_EVERY_WRITES 256 // Applied writes between ACKs at most
+#define ACK_DEFER_US 200     // Time since the last ACK at most
+
 // Command types in the replication protocol
 enum CommandType {
   CMD_SET = 1,    // Set key-value pair
   CMD_GET = 2,    // Get value for key
   CMD_DELETE = 3, // Delete key
-  CMD_ACK = 4,    // Acknowledgment from follower
-  CMD_SYNC = 5,   // Sync request from follower
+  CMD_ACK = 4,    // Follower applied everything through sequence
+  CMD_SYNC = 5,   // Leader to new follower: stream starts after sequence
   CMD_LIST = 6,   // List keys and values on nodes
+  CMD_BATCH = 7,  // Writes numbered from sequence, their frames in value
 };
 
 // Message structure sent over sockets
 // This is the protocol for communication
 struct Message {
   CommandType cmd;
-  char key[MAX_KEY_SIZE];
-  char value[MAX_VALUE_SIZE];
-  char response[MAX_VALUE_SIZE];
+  std::string key;
+  std::string value;
+  std::string response;
   int status;        // 0 = success, -1 = error
   uint64_t sequence; // Sequence number for ordering operations
   int followerId;    // ID of follower sending ACK
 
-  Message() : cmd(CMD_SET), status(0), sequence(0), followerId(-1) {
-    memset(key, 0, MAX_KEY_SIZE);
-    memset(value, 0, MAX_VALUE_SIZE);
-    memset(response, 0, MAX_VALUE_SIZE);
+  Message() : cmd(CMD_SET), status(0), sequence(0), followerId(-1) {}
+};
+
+// Wire format: every message is one frame, integers big-endian.
+//
+//   u32  length of the rest of the frame
+//   u8   cmd
+//   u8   fields present (FIELD_* bits)
+//   then each present field, in bit order
+//
+// A field is sent only when it differs from its default, so a client's SET
+// carries just its key and value, and a follower's ACK its sequence and id.
+enum MessageField : uint8_t {
+  FIELD_KEY = 1 << 0,      // u16 length, bytes
+  FIELD_VALUE = 1 << 1,    // u32 length, bytes
+  FIELD_RESPONSE = 1 << 2, // u32 length, bytes
+  FIELD_STATUS = 1 << 3,   // i32
+  FIELD_SEQUENCE = 1 << 4, // u64
+  FIELD_FOLLOWER = 1 << 5, // i32
+};
+
+inline void putWire(std::string &out, uint64_t v, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--)
+    out.push_back((char)(v >> (8 * i)));
+}
+
+// Reads a frame's fields, failing instead of running past its end.
+class WireReader {
+public:
+  WireReader(const char *data, size_t size) : p(data), end(data + size) {}
+
+  bool get(uint64_t &v, int bytes) {
+    if (end - p < bytes)
+      return false;
+    v = 0;
+    for (int i = 0; i < bytes; i++)
+      v = v << 8 | (uint8_t)*p++;
+    return true;
   }
+
+  bool get(std::string &s, int lengthBytes, size_t maxSize) {
+    uint64_t len;
+    if (!get(len, lengthBytes) || len > maxSize || (uint64_t)(end - p) < len)
+      return false;
+    s.assign(p, len);
+    p += len;
+    return true;
+  }
+
+  bool done() const { return p == end; }
+
+private:
+  const char *p;
+  const char *end;
 };
 
-// Simple in-memory key-value store
+// The whole frame, length prefix included. Empty if the receiver would
+// refuse it: a key over MAX_KEY_SIZE or a frame over MAX_FRAME_SIZE.
+inline std::string encodeMessage(const Message &msg) {
+  if (msg.key.size() > MAX_KEY_SIZE)
+    return std::string();
+
+  uint8_t fields = 0;
+  if (!msg.key.empty())
+    fields |= FIELD_KEY;
+  if (!msg.value.empty())
+    fields |= FIELD_VALUE;
+  if (!msg.response.empty())
+    fields |= FIELD_RESPONSE;
+  if (msg.status != 0)
+    fields |= FIELD_STATUS;
+  if (msg.sequence != 0)
+    fields |= FIELD_SEQUENCE;
+  if (msg.followerId != -1)
+    fields |= FIELD_FOLLOWER;
+
+  std::string out(4, '\0');
+  out.push_back((char)msg.cmd);
+  out.push_back((char)fields);
+  if (fields & FIELD_KEY) {
+    putWire(out, msg.key.size(), 2);
+    out += msg.key;
+  }
+  if (fields & FIELD_VALUE) {
+    putWire(out, msg.value.size(), 4);
+    out += msg.value;
+  }
+  if (fields & FIELD_RESPONSE) {
+    putWire(out, msg.response.size(), 4);
+    out += msg.response;
+  }
+  if (fields & FIELD_STATUS)
+    putWire(out, (uint32_t)msg.status, 4);
+  if (fields & FIELD_SEQUENCE)
+    putWire(out, msg.sequence, 8);
+  if (fields & FIELD_FOLLOWER)
+    putWire(out, (uint32_t)msg.followerId, 4);
+
+  if (out.size() - 4 > MAX_FRAME_SIZE)
+    return std::string();
+  std::string length;
+  putWire(length, out.size() - 4, 4);
+  out.replace(0, 4, length);
+  return out;
+}
+
+// Decodes the frame body that followed the length prefix. Fields it does
+// not carry get their defaults; false if it is malformed.
+inline bool decodeMessage(const char *data, size_t size, Message &msg) {
+  msg = Message();
+  WireReader in(data, size);
+  uint64_t cmd, fields, v;
+  if (!in.get(cmd, 1) || !in.get(fields, 1))
+    return false;
+  msg.cmd = (CommandType)cmd;
+  if ((fields & FIELD_KEY) && !in.get(msg.key, 2, MAX_KEY_SIZE))
+    return false;
+  if ((fields & FIELD_VALUE) && !in.get(msg.value, 4, MAX_FRAME_SIZE))
+    return false;
+  if ((fields & FIELD_RESPONSE) && !in.get(msg.response, 4, MAX_FRAME_SIZE))
+    return false;
+  if (fields & FIELD_STATUS) {
+    if (!in.get(v, 4))
+      return false;
+    msg.status = (int32_t)v;
+  }
+  if ((fields & FIELD_SEQUENCE) && !in.get(msg.sequence, 8))
+    return false;
+  if (fields & FIELD_FOLLOWER) {
+    if (!in.get(v, 4))
+      return false;
+    msg.followerId = (int32_t)v;
+  }
+  return in.done();
+}
+
+// Sends an encoded frame, all of it. Returns false on a socket error, or
+// with errno EMSGSIZE for the empty frame of a message too big to send.
+inline bool sendFrame(int socket, const std::string &frame) {
+  if (frame.empty()) {
+    errno = EMSGSIZE;
+    return false;
+  }
+  size_t sent = 0;
+  while (sent < frame.size()) {
+    ssize_t n = send(socket, frame.data() + sent, frame.size() - sent, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  return true;
+}
+
+inline bool sendMessage(int socket, const Message &msg) {
+  return sendFrame(socket, encodeMessage(msg));
+}
+
+inline bool recvExactly(int socket, char *buf, size_t size) {
+  size_t got = 0;
+  while (got < size) {
+    ssize_t n = recv(socket, buf + got, size - got, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    got += n;
+  }
+  return true;
+}
+
+// Splits the value of a CMD_BATCH into its writes, numbered from its
+// sequence. False if it is malformed.
+inline bool decodeBatch(const Message &batch, std::vector<Message> &writes) {
+  WireReader in(batch.value.data(), batch.value.size());
+  writes.clear();
+  while (!in.done()) {
+    std::string body;
+    if (!in.get(body, 4, MAX_FRAME_SIZE))
+      return false;
+    writes.emplace_back();
+    if (!decodeMessage(body.data(), body.size(), writes.back()))
+      return false;
+    writes.back().sequence = batch.sequence + writes.size() - 1;
+  }
+  return true;
+}
+
+// Blocks for the next whole message. Returns false once the connection is
+// closed, fails, or sends a malformed or oversized frame.
+inline bool recvMessage(int socket, Message &msg) {
+  char prefix[4];
+  if (!recvExactly(socket, prefix, sizeof(prefix)))
+    return false;
+  uint64_t length;
+  WireReader(prefix, sizeof(prefix)).get(length, 4);
+  if (length > MAX_FRAME_SIZE)
+    return false;
+  std::string body(length, '\0');
+  return recvExactly(socket, &body[0], length) &&
+         decodeMessage(body.data(), body.size(), msg);
+}
+
+// Thread-safe in-memory key-value store. Keys are spread over STORE_SHARDS
+// shards by hash, each a map behind its own reader-writer lock: GETs run in
+// parallel, and a write only holds up readers of the same shard.
 class KeyValueStore {
 private:
-  std::unordered_map<std::string, std::string> data;
+  struct alignas(64) Shard {
+    mutable std::shared_mutex mtx;
+    std::unordered_map<std::string, std::string> data;
+  };
+  Shard shards[STORE_SHARDS];
+
+  Shard &shardOf(const std::string &key) {
+    return shards[std::hash<std::string>{}(key) % STORE_SHARDS];
+  }
+  const Shard &shardOf(const std::string &key) const {
+    return shards[std::hash<std::string>{}(key) % STORE_SHARDS];
+  }
 
 public:
   // Set a key-value pair
   void set(const std::string &key, const std::string &value) {
-    data[key] = value;
+    Shard &shard = shardOf(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mtx);
+    shard.data[key] = value;
   }
 
   // Get value for a key
   bool get(const std::string &key, std::string &value) const {
-    auto it = data.find(key);
-    if (it != data.end()) {
+    const Shard &shard = shardOf(key);
+    std::shared_lock<std::shared_mutex> lock(shard.mtx);
+    auto it = shard.data.find(key);
+    if (it != shard.data.end()) {
       value = it->second;
       return true;
     }
@@ -68,11 +302,21 @@ public:
   }
 
   // Delete a key
-  bool deleteKey(const std::string &key) { return data.erase(key) > 0; }
+  bool deleteKey(const std::string &key) {
+    Shard &shard = shardOf(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mtx);
+    return shard.data.erase(key) > 0;
+  }
 
-  // Get all data (for synchronization)
-  const std::unordered_map<std::string, std::string> &getAllData() const {
-    return data;
+  // Get a copy of all data (for synchronization). Each shard is copied
+  // consistently, but writes may land between shards.
+  std::unordered_map<std::string, std::string> getAllData() const {
+    std::unordered_map<std::string, std::string> all;
+    for (const Shard &shard : shards) {
+      std::shared_lock<std::shared_mutex> lock(shard.mtx);
+      all.insert(shard.data.begin(), shard.data.end());
+    }
+    return all;
   }
 };
 
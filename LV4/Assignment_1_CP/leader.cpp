@@ -1,49 +1,186 @@
+#include "../../common/async_logger.h"
 #include "kv_store.h"
 #include <algorithm>
 #include <arpa/inet.h>
 #include <atomic>
+#include <climits>
 #include <condition_variable>
 #include <csignal>
 #include <fcntl.h>
 #include <iostream>
-#include <map>
+#include <memory>
 #include <mutex>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <thread>
 #include <unistd.h>
 #include <vector>
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
 
 KeyValueStore store;
-std::vector<int> followerSockets;
+std::mutex commitMutex; // Batches are committed one at a time, in order
+
+// A connected follower. Writes reach it in batches, several in flight at
+// once; it applies them in order and ACKs cumulatively.
+struct Follower {
+  int socket;
+  int id;
+  // Highest sequence it has ACKed; everything up to it is applied there,
+  // and the first batch it has not ACKed yet. Only its receiveAcks thread
+  // writes them once it is registered.
+  uint64_t ackedThrough = 0;
+  uint64_t nextBatch = 0;
+};
+
+// Sequence and batch numbers are assigned under socketsMutex, together with
+// the snapshot of the followers a batch goes to, so a new follower gets
+// every write numbered after it joined and none before.
+std::vector<std::shared_ptr<Follower>> followers;
 std::mutex socketsMutex;
-std::atomic<uint64_t> sequenceCounter{0};
-
-// Track pending ACKs for each sequence number
-struct PendingOperation {
-  int expectedAcks;
-  int receivedAcks;
-  std::mutex mtx;
-  std::condition_variable cv;
-  bool completed;
-  bool success;
+uint64_t sequenceCounter = 0;
+
+// Group commit: writes arriving together are replicated as one batch, one
+// frame and one ACK per follower. Once enough followers ACK it, the batch is
+// committed locally, in sequence order, and its client threads are released
+// together.
+//
+// Batches live in a preallocated ring, batch n in slot n % PENDING_SLOTS, so
+// tracking one allocates nothing and ACKs take no lock: a follower's ACK
+// bumps the counter of each batch it covers, and the one that completes a
+// batch commits it. Writers block on the slot's state word.
+enum SlotState : uint32_t {
+  SLOT_FREE,
+  SLOT_OPEN,      // Writers are joining it
+  SLOT_SENT,      // Replicated, waiting for ACKs
+  SLOT_ACKED,     // Enough ACKs, waiting for earlier batches to commit
+  SLOT_COMMITTED, // Applied locally; writers read their results
+};
+
+struct BatchSlot {
+  std::atomic<uint32_t> state{SLOT_FREE};
+  // Batch number (low 32 bits) << 32 | ACKs needed << 16 | ACKs received.
+  // Carrying the number lets a follower's ACK tell that the slot has been
+  // reused for a later batch.
+  std::atomic<uint64_t> acks{0};
+  std::atomic<uint64_t> lastSequence{0}; // The ACK that covers the batch
+  // Writers still to read their results, plus one until committed
+  std::atomic<int> holders{0};
+  std::vector<Message> writes;
+  std::vector<bool> changed; // Per write, once committed: did it find a key
+  size_t bytes = 0;
+  std::chrono::steady_clock::time_point opened;
 };
 
-std::map<uint64_t, PendingOperation *> pendingOps;
-std::mutex pendingOpsMutex;
+BatchSlot batchRing[PENDING_SLOTS];
+
+// Batches writers are joining and the batcher has yet to send, by number;
+// both under batchMutex
+uint64_t openBatch = 0;
+uint64_t nextToSend = 0;
+std::mutex batchMutex;
+std::condition_variable batchCv;
+
+// Batches numbered so far, and committed so far (under commitMutex)
+std::atomic<uint64_t> batchesSent{0};
+std::atomic<uint64_t> batchesCommitted{0};
+
+BatchSlot &slotOf(uint64_t batch) { return batchRing[batch % PENDING_SLOTS]; }
+
+bool acksFor(uint64_t acks, uint64_t batch) {
+  return acks >> 32 == (uint32_t)batch;
+}
+
+bool batchFull(const BatchSlot &slot) {
+  return slot.writes.size() >= MAX_BATCH_WRITES ||
+         slot.bytes >= MAX_BATCH_BYTES;
+}
+
+// Block until done(word) holds or deadline passes; false on timeout
+template <typename Done>
+bool waitForState(std::atomic<uint32_t> &word, Done done,
+                  std::chrono::steady_clock::time_point deadline) {
+  while (true) {
+    uint32_t value = word.load();
+    if (done(value))
+      return true;
+    auto left = deadline - std::chrono::steady_clock::now();
+    if (left <= std::chrono::steady_clock::duration::zero())
+      return false;
+#ifdef __linux__
+    auto ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+    timespec timeout = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, value, &timeout, nullptr, 0);
+#else
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+  }
+}
+
+// Set a state writers may be waiting for, and wake them
+void setState(std::atomic<uint32_t> &word, uint32_t value) {
+  word.store(value);
+#ifdef __linux__
+  syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+// A writer, or the commit, is done with the slot; the last frees it
+void releaseSlot(BatchSlot &slot) {
+  if (--slot.holders == 0) {
+    setState(slot.state, SLOT_FREE);
+  }
+}
+
+// Apply every ACKed batch whose turn has come to the local store, in order,
+// and release their writers
+void commitReady() {
+  std::lock_guard<std::mutex> lock(commitMutex);
+  uint64_t batch = batchesCommitted.load();
+  while (batch < batchesSent.load() &&
+         slotOf(batch).state.load() == SLOT_ACKED) {
+    BatchSlot &slot = slotOf(batch);
+    for (const Message &write : slot.writes) {
+      if (write.cmd == CMD_SET) {
+        store.set(write.key, write.value);
+        slot.changed.push_back(true);
+      } else {
+        slot.changed.push_back(store.deleteKey(write.key));
+      }
+    }
+    setState(slot.state, SLOT_COMMITTED);
+    releaseSlot(slot);
+    batchesCommitted.store(++batch);
+  }
+}
+
+// Count one follower's ACK for batch, unless the slot has moved on to a
+// later batch: then this one completed without it
+void countAck(BatchSlot &slot, uint64_t batch) {
+  uint64_t acks = slot.acks.load();
+  do {
+    if (!acksFor(acks, batch))
+      return;
+  } while (!slot.acks.compare_exchange_weak(acks, acks + 1));
+
+  if ((acks & 0xffff) + 1 == (acks >> 16 & 0xffff)) {
+    slot.state.store(SLOT_ACKED);
+    commitReady();
+  }
+}
 
 // Thread to receive ACKs from a specific follower
-void receiveAcks(int followerSocket, int followerId) {
+void receiveAcks(std::shared_ptr<Follower> follower) {
   Message ackMsg;
 
   while (true) {
-    int bytesReceived =
-        recv(followerSocket, (char *)&ackMsg, sizeof(Message), 0);
-
-    if (bytesReceived <= 0) {
-      std::cout << "[LEADER] Follower " << followerId << " disconnected"
-                << std::endl;
+    if (!recvMessage(follower->socket, ackMsg)) {
+      LOG_WARN("[LEADER] Follower " << follower->id << " disconnected");
 
       // STRICT CP: Do NOT remove from follower list.
       // If we remove it, the next write succeeds with N-1 nodes (AP-like
@@ -54,122 +191,203 @@ void receiveAcks(int followerSocket, int followerId) {
       // Remove from follower list
       {
         std::lock_guard<std::mutex> lock(socketsMutex);
-        auto it = std::find(followerSockets.begin(), followerSockets.end(),
-                            followerSocket);
-        if (it != followerSockets.end()) {
-          followerSockets.erase(it);
+        auto it = std::find(followers.begin(), followers.end(), follower);
+        if (it != followers.end()) {
+          followers.erase(it);
         }
       }
       */
       break;
     }
 
-    if (ackMsg.cmd == CMD_ACK) {
-      uint64_t seq = ackMsg.sequence;
-
-      std::lock_guard<std::mutex> lock(pendingOpsMutex);
-      auto it = pendingOps.find(seq);
-      if (it != pendingOps.end()) {
-        PendingOperation *op = it->second;
-        std::lock_guard<std::mutex> opLock(op->mtx);
-        op->receivedAcks++;
-
-        std::cout << "[LEADER] Received ACK for seq " << seq
-                  << " from follower " << ackMsg.followerId << " ("
-                  << op->receivedAcks << "/" << op->expectedAcks << ")"
-                  << std::endl;
-
-        // Check if we have enough ACKs
-        if (REQUIRE_ALL_ACKS) {
-          if (op->receivedAcks >= op->expectedAcks) {
-            op->completed = true;
-            op->success = true;
-            op->cv.notify_all();
-          }
-        } else {
-          // Quorum-based: majority is enough
-          int majority = (op->expectedAcks / 2) + 1;
-          if (op->receivedAcks >= majority) {
-            op->completed = true;
-            op->success = true;
-            op->cv.notify_all();
-          }
+    // A cumulative ACK: the follower applied everything through seq, so it
+    // counts for every batch it was sent up to there
+    if (ackMsg.cmd == CMD_ACK && ackMsg.sequence > follower->ackedThrough) {
+      follower->ackedThrough = ackMsg.sequence;
+
+      LOG_DEBUG("[LEADER] Follower " << ackMsg.followerId
+                << " applied through seq " << ackMsg.sequence);
+
+      while (follower->nextBatch < batchesSent.load()) {
+        BatchSlot &slot = slotOf(follower->nextBatch);
+        if (acksFor(slot.acks.load(), follower->nextBatch) &&
+            slot.lastSequence.load() > ackMsg.sequence) {
+          break;
         }
+        countAck(slot, follower->nextBatch++);
       }
     }
   }
 
-  close(followerSocket);
+  // Kept open while the follower stays on the list, so the descriptor
+  // cannot be reused by another connection that writes would then reach
+  shutdown(follower->socket, SHUT_RDWR);
 }
 
-// Broadcast replication log to all followers and wait for ACKs
-bool broadcastAndWaitForAcks(const Message &msg) {
-  std::vector<int> currentFollowers;
+// Number a batch's writes and send it to all followers, without waiting for
+// their ACKs: the next batch can go out while this one is in flight
+void replicateBatch(uint64_t batch) {
+  BatchSlot &slot = slotOf(batch);
+  std::vector<std::shared_ptr<Follower>> currentFollowers;
+  uint64_t firstSequence;
 
   {
     std::lock_guard<std::mutex> lock(socketsMutex);
-    currentFollowers = followerSockets;
+    firstSequence = sequenceCounter + 1;
+    sequenceCounter += slot.writes.size();
+    currentFollowers = followers;
+
+    uint64_t numFollowers = currentFollowers.size();
+    uint64_t neededAcks = REQUIRE_ALL_ACKS ? numFollowers
+                                           : (numFollowers / 2) + 1;
+    slot.lastSequence.store(sequenceCounter);
+    slot.acks.store(batch << 32 | neededAcks << 16);
+    batchesSent.store(batch + 1);
   }
 
-  int numFollowers = currentFollowers.size();
-
   // If no followers, operation succeeds immediately
-  if (numFollowers == 0) {
-    std::cout
-        << "[LEADER] No followers connected, proceeding without replication"
-        << std::endl;
-    return true;
+  if (currentFollowers.empty()) {
+    LOG_DEBUG(
+        "[LEADER] No followers connected, proceeding without replication");
+    slot.state.store(SLOT_ACKED);
+    commitReady();
+    return;
   }
 
-  // Create pending operation tracker
-  PendingOperation *op = new PendingOperation();
-  op->expectedAcks = numFollowers;
-  op->receivedAcks = 0;
-  op->completed = false;
-  op->success = false;
-
-  {
-    std::lock_guard<std::mutex> lock(pendingOpsMutex);
-    pendingOps[msg.sequence] = op;
+  // A lone write goes as itself; several as one CMD_BATCH frame whose value
+  // holds their frames and whose sequence is the first one's
+  Message frameMsg;
+  if (slot.writes.size() == 1) {
+    frameMsg = slot.writes.front();
+  } else {
+    frameMsg.cmd = CMD_BATCH;
+    for (const Message &write : slot.writes) {
+      frameMsg.value += encodeMessage(write);
+    }
   }
+  frameMsg.sequence = firstSequence;
+  std::string frame = encodeMessage(frameMsg);
 
   // Send to all followers
-  std::cout << "[LEADER] Broadcasting seq " << msg.sequence << " to "
-            << numFollowers << " followers" << std::endl;
+  LOG_DEBUG("[LEADER] Broadcasting seq " << firstSequence << ".."
+            << slot.lastSequence.load() << " to " << currentFollowers.size()
+            << " followers");
 
-  for (int followerSocket : currentFollowers) {
-    if (send(followerSocket, (const char *)&msg, sizeof(Message), 0) == -1) {
-      std::cout << "[LEADER] Failed to send to follower " << followerSocket
-                << std::endl;
+  for (const auto &follower : currentFollowers) {
+    if (!sendFrame(follower->socket, frame)) {
+      LOG_WARN("[LEADER] Failed to send to follower " << follower->id);
       // Do not continue or exit, just print error.
-      // The pendingOp will time out because this follower won't ACK.
+      // The batch will time out because this follower won't ACK.
     }
   }
+}
 
-  // Wait for ACKs with timeout
-  bool success = false;
-  {
-    std::unique_lock<std::mutex> lock(op->mtx);
-    success = op->cv.wait_for(lock, std::chrono::milliseconds(ACK_TIMEOUT_MS),
-                              [op]() { return op->completed; });
-
-    if (!success) {
-      std::cout << "[LEADER] TIMEOUT waiting for ACKs on seq " << msg.sequence
-                << " (received " << op->receivedAcks << "/" << op->expectedAcks
-                << ")" << std::endl;
+// Close batches and replicate them. A batch stays open for more writes for
+// BATCH_WINDOW_US while earlier ones are still in flight, or until it fills;
+// with nothing in flight, waiting would only add latency.
+void runBatcher() {
+  while (true) {
+    uint64_t batch;
+    {
+      std::unique_lock<std::mutex> lock(batchMutex);
+      batchCv.wait(lock, []() {
+        return slotOf(nextToSend).state.load() == SLOT_OPEN;
+      });
+      batch = nextToSend;
+      BatchSlot &slot = slotOf(batch);
+
+      if (batchesCommitted.load() < batchesSent.load()) {
+        batchCv.wait_until(
+            lock, slot.opened + std::chrono::microseconds(BATCH_WINDOW_US),
+            [&slot]() { return openBatch > nextToSend || batchFull(slot); });
+      }
+
+      // Closed: later writers open the next batch
+      slot.state.store(SLOT_SENT);
+      if (openBatch == batch) {
+        openBatch++;
+      }
+      nextToSend++;
     }
+    replicateBatch(batch);
   }
+}
+
+// Replicate msg to all followers as part of a batch, wait for their ACKs and
+// commit it. changed tells whether a DELETE found its key.
+bool broadcastAndWaitForAcks(const Message &msg, bool &changed) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(ACK_TIMEOUT_MS);
+  size_t bytes = msg.key.size() + msg.value.size();
+  uint64_t batch;
+  size_t index;
+  bool wakeBatcher = false;
 
-  // Cleanup
   {
-    std::lock_guard<std::mutex> lock(pendingOpsMutex);
-    pendingOps.erase(msg.sequence);
+    std::unique_lock<std::mutex> lock(batchMutex);
+    while (true) {
+      batch = openBatch;
+      BatchSlot &slot = slotOf(batch);
+      uint32_t state = slot.state.load();
+
+      if (state == SLOT_OPEN) {
+        if (!batchFull(slot) && slot.bytes + bytes <= MAX_BATCH_BYTES) {
+          break;
+        }
+        // Full: it waits for the batcher, and we for the next slot
+        openBatch++;
+        continue;
+      }
+
+      if (state == SLOT_FREE) {
+        slot.writes.clear();
+        slot.changed.clear();
+        slot.bytes = 0;
+        slot.opened = std::chrono::steady_clock::now();
+        slot.holders.store(1);
+        slot.state.store(SLOT_OPEN);
+        wakeBatcher = true;
+        break;
+      }
+
+      // PENDING_SLOTS batches are in flight: wait for the oldest to be done
+      lock.unlock();
+      bool freed = waitForState(
+          slot.state, [](uint32_t s) { return s == SLOT_FREE; }, deadline);
+      lock.lock();
+      if (!freed) {
+        LOG_WARN("[LEADER] TIMEOUT waiting for a free batch slot");
+        return false;
+      }
+    }
+
+    BatchSlot &slot = slotOf(batch);
+    index = slot.writes.size();
+    slot.writes.push_back(msg);
+    slot.bytes += bytes;
+    slot.holders++;
+    wakeBatcher = wakeBatcher || batchFull(slot);
+  }
+  if (wakeBatcher) {
+    batchCv.notify_one();
   }
 
-  bool result = op->success;
-  delete op;
+  // Wait for ACKs with timeout
+  BatchSlot &slot = slotOf(batch);
+  bool success = waitForState(
+      slot.state, [](uint32_t s) { return s == SLOT_COMMITTED; }, deadline);
+
+  if (success) {
+    changed = slot.changed[index];
+  } else {
+    uint64_t acks = slot.acks.load();
+    LOG_WARN("[LEADER] TIMEOUT waiting for ACKs on seq "
+             << slot.lastSequence.load() << " (received " << (acks & 0xffff)
+             << "/" << (acks >> 16 & 0xffff) << ")");
+  }
+  releaseSlot(slot);
 
-  return result;
+  return success;
 }
 
 // Handle a single client connection
@@ -178,7 +396,7 @@ void handleClient(int clientSocket) {
 
   while (true) {
     // Receive message from client
-    if (recv(clientSocket, (char *)&msg, sizeof(Message), 0) <= 0) {
+    if (!recvMessage(clientSocket, msg)) {
       break; // Client disconnected
     }
 
@@ -186,30 +404,24 @@ void handleClient(int clientSocket) {
     std::string value(msg.value);
 
     if (msg.cmd == CMD_SET) {
-      // Assign sequence number
-      msg.sequence = ++sequenceCounter;
-
-      std::cout << "[LEADER] Processing SET " << key << " = " << value
-                << " (seq: " << msg.sequence << ")" << std::endl;
+      LOG_DEBUG("[LEADER] Processing SET " << key << " = " << value);
 
       // In CP system: first replicate, then commit locally
       // This ensures all nodes have the data before confirming
 
-      bool replicationSuccess = broadcastAndWaitForAcks(msg);
+      bool changed;
+      bool replicationSuccess = broadcastAndWaitForAcks(msg, changed);
 
       if (replicationSuccess) {
-        // All followers acknowledged, now commit locally
-        store.set(key, value);
+        // All followers acknowledged, and it is committed locally
         msg.status = 0;
-        snprintf(msg.response, MAX_VALUE_SIZE,
-                 "SET %s = %s (replicated to all nodes)", key.c_str(),
-                 value.c_str());
+        msg.response =
+            "SET " + key + " = " + value + " (replicated to all nodes)";
       } else {
         // CP guarantee: if we can't replicate to all, we fail the operation
         msg.status = -1;
-        snprintf(msg.response, MAX_VALUE_SIZE,
-                 "FAILED: Could not replicate to all followers (CP violation "
-                 "prevented)");
+        msg.response = "FAILED: Could not replicate to all followers (CP "
+                       "violation prevented)";
       }
 
     } else if (msg.cmd == CMD_GET) {
@@ -217,33 +429,27 @@ void handleClient(int clientSocket) {
       std::string result;
       if (store.get(key, result)) {
         msg.status = 0;
-        snprintf(msg.response, MAX_VALUE_SIZE, "%s", result.c_str());
+        msg.response = result;
       } else {
         msg.status = -1;
-        snprintf(msg.response, MAX_VALUE_SIZE, "Key not found");
+        msg.response = "Key not found";
       }
 
     } else if (msg.cmd == CMD_DELETE) {
-      // Assign sequence number
-      msg.sequence = ++sequenceCounter;
-
-      std::cout << "[LEADER] Processing DELETE " << key
-                << " (seq: " << msg.sequence << ")" << std::endl;
+      LOG_DEBUG("[LEADER] Processing DELETE " << key);
 
       // In CP system: first replicate, then commit locally
-      bool replicationSuccess = broadcastAndWaitForAcks(msg);
+      bool deleted;
+      bool replicationSuccess = broadcastAndWaitForAcks(msg, deleted);
 
       if (replicationSuccess) {
-        bool deleted = store.deleteKey(key);
         msg.status = deleted ? 0 : -1;
-        snprintf(msg.response, MAX_VALUE_SIZE, "%s",
-                 deleted ? "Key deleted (replicated to all nodes)"
-                         : "Key not found");
+        msg.response = deleted ? "Key deleted (replicated to all nodes)"
+                               : "Key not found";
       } else {
         msg.status = -1;
-        snprintf(msg.response, MAX_VALUE_SIZE,
-                 "FAILED: Could not replicate to all followers (CP violation "
-                 "prevented)");
+        msg.response = "FAILED: Could not replicate to all followers (CP "
+                       "violation prevented)";
       }
 
     } else if (msg.cmd == CMD_LIST) {
@@ -252,14 +458,14 @@ void handleClient(int clientSocket) {
       std::string listStr = "Keys: ";
       for (auto const &[k, v] : data) {
         listStr += k + "=" + v + "; ";
-        std::cout << k << ":" << v << std::endl;
+        LOG_DEBUG(k << ":" << v);
       }
       msg.status = 0;
-      snprintf(msg.response, MAX_VALUE_SIZE, "%s", listStr.c_str());
+      msg.response = listStr;
     }
 
     // Send response back to client
-    if (send(clientSocket, (char *)&msg, sizeof(Message), 0) == -1) {
+    if (!sendMessage(clientSocket, msg)) {
       perror("Failed to send response");
       break;
     }
@@ -282,19 +488,36 @@ void acceptFollowers(int registrationSocket) {
       continue;
     }
 
-    int followerId = ++followerIdCounter;
+    // Several writes are in flight at once; don't let Nagle hold one back
+    // until the previous is acknowledged
+    int noDelay = 1;
+    setsockopt(followerSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+               sizeof(noDelay));
 
+    auto follower = std::make_shared<Follower>();
+    follower->socket = followerSocket;
+    follower->id = ++followerIdCounter;
+
+    // Tell the follower where its stream starts, before any write can
+    // reach it: it gets every sequence after this one
+    size_t total;
     {
       std::lock_guard<std::mutex> lock(socketsMutex);
-      followerSockets.push_back(followerSocket);
+      follower->ackedThrough = sequenceCounter;
+      follower->nextBatch = batchesSent.load();
+      Message start;
+      start.cmd = CMD_SYNC;
+      start.sequence = sequenceCounter;
+      sendMessage(followerSocket, start);
+      followers.push_back(follower);
+      total = followers.size();
     }
 
-    std::cout << "[LEADER] New follower " << followerId
-              << " connected (total: " << followerSockets.size() << ")"
-              << std::endl;
+    LOG_INFO("[LEADER] New follower " << follower->id
+             << " connected (total: " << total << ")");
 
     // Start thread to receive ACKs from this follower
-    std::thread ackThread(receiveAcks, followerSocket, followerId);
+    std::thread ackThread(receiveAcks, follower);
     ackThread.detach();
   }
 }
@@ -330,7 +553,11 @@ int main() {
   }
 
   listen(regSocket, 10);
-  std::cout << "[LEADER] Follower registration on port 8080" << std::endl;
+  LOG_INFO("[LEADER] Follower registration on port 8080");
+
+  // Start thread to replicate batches of writes
+  std::thread batcherThread(runBatcher);
+  batcherThread.detach();
 
   // Start thread to accept follower registrations
   std::thread followerAcceptThread(acceptFollowers, regSocket);
@@ -354,8 +581,7 @@ int main() {
   }
 
   listen(clientSocket, 10);
-  std::cout << "[LEADER] Client connections on port 8000" << std::endl;
-  std::cout << std::endl;
+  LOG_INFO("[LEADER] Client connections on port 8000");
 
   // Main loop: accept client connections
   while (true) {
@@ -368,7 +594,7 @@ int main() {
       continue;
     }
 
-    std::cout << "[LEADER] New client connected" << std::endl;
+    LOG_INFO("[LEADER] New client connected");
 
     // Handle each client in a separate thread
     std::thread clientThread(handleClient, connSocket);
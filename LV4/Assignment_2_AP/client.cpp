@@ -113,20 +113,20 @@ int main() {
       std::getline(iss >> std::ws, value);
 
       msg.cmd = CMD_SET;
-      strncpy(msg.key, key.c_str(), MAX_KEY_SIZE - 1);
-      strncpy(msg.value, value.c_str(), MAX_VALUE_SIZE - 1);
+      msg.key = key.substr(0, MAX_KEY_SIZE);
+      msg.value = value;
 
     } else if (command == "GET") {
       std::string key;
       iss >> key;
       msg.cmd = CMD_GET;
-      strncpy(msg.key, key.c_str(), MAX_KEY_SIZE - 1);
+      msg.key = key.substr(0, MAX_KEY_SIZE);
 
     } else if (command == "DELETE") {
       std::string key;
       iss >> key;
       msg.cmd = CMD_DELETE;
-      strncpy(msg.key, key.c_str(), MAX_KEY_SIZE - 1);
+      msg.key = key.substr(0, MAX_KEY_SIZE);
 
     } else if (command == "LIST") {
       msg.cmd = CMD_LIST;
@@ -139,13 +139,17 @@ int main() {
     // Measure response time
     auto startTime = std::chrono::high_resolution_clock::now();
 
-    if (send(clientSocket, (char *)&msg, sizeof(Message), 0) == -1) {
+    if (!sendMessage(clientSocket, msg)) {
+      if (errno == EMSGSIZE) {
+        std::cout << "[ERROR] Message too large to send" << std::endl;
+        continue;
+      }
       perror("Failed to send message");
       break;
     }
 
     Message response;
-    if (recv(clientSocket, (char *)&response, sizeof(Message), 0) <= 0) {
+    if (!recvMessage(clientSocket, response)) {
       std::cout << "Connection lost" << std::endl;
       break;
     }
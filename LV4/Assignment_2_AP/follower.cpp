@@ -1,3 +1,4 @@
+#include "../../common/async_logger.h"
 #include "kv_store.h"
 #include <algorithm>
 #include <arpa/inet.h>
@@ -35,10 +36,10 @@ void requestSync(int leaderSocket) {
   syncReq.cmd = CMD_SYNC;
   syncReq.sequence = lastSequence;
 
-  std::cout << "[FOLLOWER-AP " << followerId << "] Requesting sync from seq "
-            << lastSequence << std::endl;
+  LOG_INFO("[FOLLOWER-AP " << followerId << "] Requesting sync from seq "
+           << lastSequence);
 
-  if (send(leaderSocket, (char *)&syncReq, sizeof(Message), 0) == -1) {
+  if (!sendMessage(leaderSocket, syncReq)) {
     perror("Failed to send sync request");
     return;
   }
@@ -46,16 +47,15 @@ void requestSync(int leaderSocket) {
   // Receive all missed operations
   Message msg;
   while (true) {
-    int bytes = recv(leaderSocket, (char *)&msg, sizeof(Message), 0);
-    if (bytes <= 0)
+    if (!recvMessage(leaderSocket, msg))
       break;
 
     if (msg.cmd == CMD_ACK) {
       // Sync complete
       lastSequence = msg.sequence;
       saveSequence();
-      std::cout << "[FOLLOWER-AP " << followerId
-                << "] Sync complete, now at seq " << lastSequence << std::endl;
+      LOG_INFO("[FOLLOWER-AP " << followerId << "] Sync complete, now at seq "
+               << lastSequence);
       break;
     }
 
@@ -65,13 +65,12 @@ void requestSync(int leaderSocket) {
 
     if (msg.cmd == CMD_SET) {
       store.set(key, value);
-      std::cout << "[FOLLOWER-AP " << followerId << "] Synced SET " << key
-                << " = " << value << " (seq: " << msg.sequence << ")"
-                << std::endl;
+      LOG_DEBUG("[FOLLOWER-AP " << followerId << "] Synced SET " << key
+                << " = " << value << " (seq: " << msg.sequence << ")");
     } else if (msg.cmd == CMD_DELETE) {
       store.deleteKey(key);
-      std::cout << "[FOLLOWER-AP " << followerId << "] Synced DELETE " << key
-                << " (seq: " << msg.sequence << ")" << std::endl;
+      LOG_DEBUG("[FOLLOWER-AP " << followerId << "] Synced DELETE " << key
+                << " (seq: " << msg.sequence << ")");
     }
 
     if (msg.sequence > lastSequence) {
@@ -84,15 +83,11 @@ void requestSync(int leaderSocket) {
 void listenForUpdates(int leaderSocket) {
   Message msg;
 
-  std::cout << "[FOLLOWER-AP " << followerId << "] Connected and listening"
-            << std::endl;
+  LOG_INFO("[FOLLOWER-AP " << followerId << "] Connected and listening");
 
   while (true) {
-    int bytesReceived = recv(leaderSocket, (char *)&msg, sizeof(Message), 0);
-
-    if (bytesReceived <= 0) {
-      std::cout << "[FOLLOWER-AP " << followerId
-                << "] Lost connection to leader" << std::endl;
+    if (!recvMessage(leaderSocket, msg)) {
+      LOG_WARN("[FOLLOWER-AP " << followerId << "] Lost connection to leader");
       break;
     }
 
@@ -103,23 +98,21 @@ void listenForUpdates(int leaderSocket) {
       store.set(key, value);
       lastSequence = msg.sequence;
       saveSequence();
-      std::cout << "[FOLLOWER-AP " << followerId << "] Applied SET " << key
-                << " = " << value << " (seq: " << msg.sequence << ")"
-                << std::endl;
+      LOG_DEBUG("[FOLLOWER-AP " << followerId << "] Applied SET " << key
+                << " = " << value << " (seq: " << msg.sequence << ")");
 
     } else if (msg.cmd == CMD_DELETE) {
       store.deleteKey(key);
       lastSequence = msg.sequence;
       saveSequence();
-      std::cout << "[FOLLOWER-AP " << followerId << "] Applied DELETE " << key
-                << " (seq: " << msg.sequence << ")" << std::endl;
+      LOG_DEBUG("[FOLLOWER-AP " << followerId << "] Applied DELETE " << key
+                << " (seq: " << msg.sequence << ")");
 
     } else if (msg.cmd == CMD_LIST) {
       const auto &data = store.getAllData();
-      std::cout << "[FOLLOWER-AP " << followerId
-                << "] Current data:" << std::endl;
+      LOG_DEBUG("[FOLLOWER-AP " << followerId << "] Current data:");
       for (const auto &[k, v] : data) {
-        std::cout << "  " << k << ": " << v << std::endl;
+        LOG_DEBUG("  " << k << ": " << v);
       }
     }
   }
@@ -162,8 +155,8 @@ int main(int argc, char *argv[]) {
 
   // Load last known sequence (for reconnection sync)
   loadSequence();
-  std::cout << "[FOLLOWER-AP " << followerId
-            << "] Last known seq: " << lastSequence << std::endl;
+  LOG_INFO("[FOLLOWER-AP " << followerId << "] Last known seq: "
+           << lastSequence);
 
   // Retry connection with exponential backoff
   while (true) {
@@ -176,16 +169,15 @@ int main(int argc, char *argv[]) {
       if (leaderSocket >= 0)
         break;
 
-      std::cout << "[FOLLOWER-AP " << followerId
-                << "] Waiting for leader... (retry in " << retryDelay << "s)"
-                << std::endl;
+      LOG_INFO("[FOLLOWER-AP " << followerId
+               << "] Waiting for leader... (retry in " << retryDelay << "s)");
       sleep(retryDelay);
       retryDelay = std::min(retryDelay * 2, 30);
     }
 
     if (leaderSocket < 0) {
-      std::cout << "[FOLLOWER-AP " << followerId
-                << "] Could not connect to leader" << std::endl;
+      LOG_WARN("[FOLLOWER-AP " << followerId
+               << "] Could not connect to leader");
       continue;
     }
 
@@ -196,8 +188,7 @@ int main(int argc, char *argv[]) {
     listenForUpdates(leaderSocket);
 
     // Connection lost - will retry
-    std::cout << "[FOLLOWER-AP " << followerId
-              << "] Will attempt reconnection..." << std::endl;
+    LOG_INFO("[FOLLOWER-AP " << followerId << "] Will attempt reconnection...");
     sleep(2);
   }
 
@@ -1,3 +1,4 @@
+#include "../../common/async_logger.h"
 #include "kv_store.h"
 #include <algorithm>
 #include <arpa/inet.h>
@@ -29,12 +30,11 @@ void broadcastToFollowersAsync(const Message &msg) {
 
   std::vector<int> deadFollowers;
 
+  std::string frame = encodeMessage(msg);
   for (int followerSocket : followerSockets) {
     // macOS Fix: Removed MSG_NOSIGNAL
-    int result = send(followerSocket, (const char *)&msg, sizeof(Message), 0);
-    if (result == -1) {
-      std::cout << "[LEADER-AP] Follower " << followerSocket << " unreachable"
-                << std::endl;
+    if (!sendFrame(followerSocket, frame)) {
+      LOG_WARN("[LEADER-AP] Follower " << followerSocket << " unreachable");
       deadFollowers.push_back(followerSocket);
     }
   }
@@ -53,7 +53,7 @@ void handleClient(int clientSocket) {
   Message msg;
 
   while (true) {
-    if (recv(clientSocket, (char *)&msg, sizeof(Message), 0) <= 0) {
+    if (!recvMessage(clientSocket, msg)) {
       break;
     }
 
@@ -65,8 +65,6 @@ void handleClient(int clientSocket) {
       store.set(key, value);
       msg.status = 0;
       msg.sequence = ++logSequence;
-      snprintf(msg.response, MAX_VALUE_SIZE, "SET %s = %s (seq: %d)",
-               key.c_str(), value.c_str(), msg.sequence);
 
       // Store in operation log for eventual consistency
       {
@@ -77,15 +75,19 @@ void handleClient(int clientSocket) {
       // Fire-and-forget broadcast to followers (async, non-blocking)
       std::thread([msg]() { broadcastToFollowersAsync(msg); }).detach();
 
+      // Only the client needs the response, so it is set after replication
+      msg.response = "SET " + key + " = " + value +
+                     " (seq: " + std::to_string(msg.sequence) + ")";
+
     } else if (msg.cmd == CMD_GET) {
       // AP: Read from local store immediately
       std::string result;
       if (store.get(key, result)) {
         msg.status = 0;
-        snprintf(msg.response, MAX_VALUE_SIZE, "%s", result.c_str());
+        msg.response = result;
       } else {
         msg.status = -1;
-        snprintf(msg.response, MAX_VALUE_SIZE, "Key not found");
+        msg.response = "Key not found";
       }
 
     } else if (msg.cmd == CMD_DELETE) {
@@ -93,8 +95,6 @@ void handleClient(int clientSocket) {
       bool deleted = store.deleteKey(key);
       msg.status = deleted ? 0 : -1;
       msg.sequence = ++logSequence;
-      snprintf(msg.response, MAX_VALUE_SIZE, "%s (seq: %d)",
-               deleted ? "Key deleted" : "Key not found", msg.sequence);
 
       // Store in operation log
       {
@@ -105,27 +105,29 @@ void handleClient(int clientSocket) {
       // Fire-and-forget broadcast
       std::thread([msg]() { broadcastToFollowersAsync(msg); }).detach();
 
+      msg.response = std::string(deleted ? "Key deleted" : "Key not found") +
+                     " (seq: " + std::to_string(msg.sequence) + ")";
+
     } else if (msg.cmd == CMD_LIST) {
       const auto &data = store.getAllData();
-      std::cout << "[LEADER-AP] Current data:" << std::endl;
+      LOG_DEBUG("[LEADER-AP] Current data:");
       for (const auto &[k, v] : data) {
-        std::cout << "  " << k << ": " << v << std::endl;
+        LOG_DEBUG("  " << k << ": " << v);
       }
       msg.status = 0;
-      snprintf(msg.response, MAX_VALUE_SIZE, "Listed %zu keys", data.size());
-
       std::thread([msg]() { broadcastToFollowersAsync(msg); }).detach();
+      msg.response = "Listed " + std::to_string(data.size()) + " keys";
 
     } else if (msg.cmd == CMD_SYNC) {
       // Follower requesting sync - send all operations from given sequence
       int fromSeq = msg.sequence;
-      std::cout << "[LEADER-AP] Sync request from seq " << fromSeq << std::endl;
+      LOG_DEBUG("[LEADER-AP] Sync request from seq " << fromSeq);
 
       std::lock_guard<std::mutex> lock(logMutex);
       int syncCount = 0;
       for (const auto &op : operationLog) {
         if (op.sequence > fromSeq) {
-          send(clientSocket, (char *)&op, sizeof(Message), 0);
+          sendMessage(clientSocket, op);
           syncCount++;
         }
       }
@@ -134,13 +136,12 @@ void handleClient(int clientSocket) {
       Message syncDone;
       syncDone.cmd = CMD_ACK;
       syncDone.sequence = logSequence;
-      snprintf(syncDone.response, MAX_VALUE_SIZE, "Synced %d operations",
-               syncCount);
+      syncDone.response = "Synced " + std::to_string(syncCount) + " operations";
       msg = syncDone;
     }
 
     // Send response to client immediately (AP: no waiting)
-    if (send(clientSocket, (char *)&msg, sizeof(Message), 0) == -1) {
+    if (!sendMessage(clientSocket, msg)) {
       perror("Failed to send response");
       break;
     }
@@ -153,17 +154,16 @@ void handleClient(int clientSocket) {
 void handleFollower(int followerSocket) {
   // First, sync the follower with current state
   Message syncMsg;
-  if (recv(followerSocket, (char *)&syncMsg, sizeof(Message), 0) > 0) {
+  if (recvMessage(followerSocket, syncMsg)) {
     if (syncMsg.cmd == CMD_SYNC) {
       int fromSeq = syncMsg.sequence;
-      std::cout << "[LEADER-AP] New follower syncing from seq " << fromSeq
-                << std::endl;
+      LOG_INFO("[LEADER-AP] New follower syncing from seq " << fromSeq);
 
       // Send all operations since their last known sequence
       std::lock_guard<std::mutex> lock(logMutex);
       for (const auto &op : operationLog) {
         if (op.sequence > fromSeq) {
-          send(followerSocket, (char *)&op, sizeof(Message), 0);
+          sendMessage(followerSocket, op);
           usleep(1000); // Small delay to prevent overflow
         }
       }
@@ -172,7 +172,7 @@ void handleFollower(int followerSocket) {
       Message ack;
       ack.cmd = CMD_ACK;
       ack.sequence = logSequence;
-      send(followerSocket, (char *)&ack, sizeof(Message), 0);
+      sendMessage(followerSocket, ack);
     }
   }
 
@@ -181,7 +181,7 @@ void handleFollower(int followerSocket) {
     std::lock_guard<std::mutex> lock(socketsMutex);
     followerSockets.push_back(followerSocket);
   }
-  std::cout << "[LEADER-AP] Follower registered and synced" << std::endl;
+  LOG_INFO("[LEADER-AP] Follower registered and synced");
 }
 
 void acceptFollowers(int registrationSocket) {
@@ -230,7 +230,7 @@ int main() {
   }
 
   listen(regSocket, 10);
-  std::cout << "[LEADER-AP] Follower registration on port 8080" << std::endl;
+  LOG_INFO("[LEADER-AP] Follower registration on port 8080");
 
   std::thread followerAcceptThread(acceptFollowers, regSocket);
   followerAcceptThread.detach();
@@ -252,7 +252,7 @@ int main() {
   }
 
   listen(clientSocket, 10);
-  std::cout << "[LEADER-AP] Client connections on port 8000" << std::endl;
+  LOG_INFO("[LEADER-AP] Client connections on port 8000");
 
   while (true) {
     struct sockaddr_in addr;
@@ -39,22 +39,28 @@ int main() {
       std::string key, value;
       iss >> key >> value;
       msg.cmd = CMD_SET;
-      strncpy(msg.key, key.c_str(), MAX_KEY_SIZE - 1);
-      strncpy(msg.value, value.c_str(), MAX_VALUE_SIZE - 1);
+      msg.key = key.substr(0, MAX_KEY_SIZE);
+      msg.value = value;
     } else if (command == "GET") {
       std::string key;
       iss >> key;
       msg.cmd = CMD_GET;
-      strncpy(msg.key, key.c_str(), MAX_KEY_SIZE - 1);
+      msg.key = key.substr(0, MAX_KEY_SIZE);
     } else {
       continue;
     }
 
     auto start = std::chrono::high_resolution_clock::now();
-    send(clientSocket, (char *)&msg, sizeof(Message), 0);
+    if (!sendMessage(clientSocket, msg)) {
+      if (errno == EMSGSIZE) {
+        std::cout << "Message too large to send" << std::endl;
+        continue;
+      }
+      break;
+    }
 
     Message response;
-    if (recv(clientSocket, (char *)&response, sizeof(Message), 0) <= 0)
+    if (!recvMessage(clientSocket, response))
       break;
 
     auto end = std::chrono::high_resolution_clock::now();
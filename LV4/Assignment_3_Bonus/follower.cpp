@@ -1,3 +1,4 @@
+#include "../../common/async_logger.h"
 #include "kv_store.h"
 #include <algorithm>
 #include <arpa/inet.h>
@@ -18,16 +19,15 @@ void requestSync(int leaderSocket) {
   Message syncReq;
   syncReq.cmd = CMD_SYNC;
   syncReq.sequence = lastSequence;
-  send(leaderSocket, (char *)&syncReq, sizeof(Message), 0);
+  sendMessage(leaderSocket, syncReq);
 
   Message msg;
   while (true) {
-    if (recv(leaderSocket, (char *)&msg, sizeof(Message), 0) <= 0)
+    if (!recvMessage(leaderSocket, msg))
       break;
     if (msg.cmd == CMD_ACK) {
       lastSequence = msg.sequence;
-      std::cout << "[FOLLOWER] Sync complete. Seq: " << lastSequence
-                << std::endl;
+      LOG_INFO("[FOLLOWER] Sync complete. Seq: " << lastSequence);
       break;
     }
     std::string key(msg.key);
@@ -35,8 +35,8 @@ void requestSync(int leaderSocket) {
     if (msg.cmd == CMD_SET) {
       // Use timestamp for conflict resolution
       if (store.set(key, value, msg.timestamp)) {
-        std::cout << "[FOLLOWER] Synced SET " << key << " = " << value
-                  << " (ts: " << msg.timestamp << ")" << std::endl;
+        LOG_DEBUG("[FOLLOWER] Synced SET " << key << " = " << value
+                  << " (ts: " << msg.timestamp << ")");
       }
     }
     if (msg.sequence > lastSequence)
@@ -46,18 +46,18 @@ void requestSync(int leaderSocket) {
 
 void listenForUpdates(int leaderSocket) {
   Message msg;
-  std::cout << "[FOLLOWER] Listening for updates..." << std::endl;
+  LOG_INFO("[FOLLOWER] Listening for updates...");
   while (true) {
-    if (recv(leaderSocket, (char *)&msg, sizeof(Message), 0) <= 0) {
-      std::cout << "[FOLLOWER] Connection lost" << std::endl;
+    if (!recvMessage(leaderSocket, msg)) {
+      LOG_WARN("[FOLLOWER] Connection lost");
       break;
     }
     std::string key(msg.key);
     std::string value(msg.value);
     if (msg.cmd == CMD_SET) {
       if (store.set(key, value, msg.timestamp)) {
-        std::cout << "[FOLLOWER] Applied SET " << key << " = " << value
-                  << " (ts: " << msg.timestamp << ")" << std::endl;
+        LOG_DEBUG("[FOLLOWER] Applied SET " << key << " = " << value
+                  << " (ts: " << msg.timestamp << ")");
       }
       lastSequence = msg.sequence;
     }
@@ -81,11 +81,11 @@ int main(int argc, char *argv[]) {
     inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
 
     if (connect(regSocket, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
-      std::cout << "[FOLLOWER] Connected to leader" << std::endl;
+      LOG_INFO("[FOLLOWER] Connected to leader");
       requestSync(regSocket);
       listenForUpdates(regSocket);
     } else {
-      std::cout << "[FOLLOWER] Waiting for leader..." << std::endl;
+      LOG_INFO("[FOLLOWER] Waiting for leader...");
       close(regSocket);
       sleep(2);
     }
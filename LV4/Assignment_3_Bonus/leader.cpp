@@ -1,3 +1,4 @@
+#include "../../common/async_logger.h"
 #include "kv_store.h"
 #include <algorithm>
 #include <arpa/inet.h>
@@ -25,9 +26,9 @@ std::atomic<int> logSequence{0};
 void broadcastToFollowersAsync(const Message &msg) {
   std::lock_guard<std::mutex> lock(socketsMutex);
   std::vector<int> deadFollowers;
+  std::string frame = encodeMessage(msg);
   for (int followerSocket : followerSockets) {
-    int result = send(followerSocket, (const char *)&msg, sizeof(Message), 0);
-    if (result == -1)
+    if (!sendFrame(followerSocket, frame))
       deadFollowers.push_back(followerSocket);
   }
   for (int dead : deadFollowers) {
@@ -41,7 +42,7 @@ void broadcastToFollowersAsync(const Message &msg) {
 void handleClient(int clientSocket) {
   Message msg;
   while (true) {
-    if (recv(clientSocket, (char *)&msg, sizeof(Message), 0) <= 0)
+    if (!recvMessage(clientSocket, msg))
       break;
 
     std::string key(msg.key);
@@ -58,44 +59,46 @@ void handleClient(int clientSocket) {
       store.set(key, value, msg.timestamp);
       msg.status = 0;
       msg.sequence = ++logSequence;
-      snprintf(msg.response, MAX_VALUE_SIZE, "SET %s = %s (seq: %d, ts: %llu)",
-               key.c_str(), value.c_str(), msg.sequence, msg.timestamp);
       {
         std::lock_guard<std::mutex> lock(logMutex);
         operationLog.push_back(msg);
       }
       std::thread([msg]() { broadcastToFollowersAsync(msg); }).detach();
+      // Set after replication: only the client needs it
+      msg.response = "SET " + key + " = " + value +
+                     " (seq: " + std::to_string(msg.sequence) +
+                     ", ts: " + std::to_string(msg.timestamp) + ")";
 
     } else if (msg.cmd == CMD_GET) {
       std::string result;
       if (store.get(key, result)) {
         msg.status = 0;
-        snprintf(msg.response, MAX_VALUE_SIZE, "%s", result.c_str());
+        msg.response = result;
       } else {
         msg.status = -1;
-        snprintf(msg.response, MAX_VALUE_SIZE, "Key not found");
+        msg.response = "Key not found";
       }
 
     } else if (msg.cmd == CMD_DELETE) {
       store.deleteKey(key, msg.timestamp);
       msg.status = 0;
       msg.sequence = ++logSequence;
-      snprintf(msg.response, MAX_VALUE_SIZE, "Deleted %s (seq: %d, ts: %llu)",
-               key.c_str(), msg.sequence, msg.timestamp);
       {
         std::lock_guard<std::mutex> lock(logMutex);
         operationLog.push_back(msg);
       }
       std::thread([msg]() { broadcastToFollowersAsync(msg); }).detach();
+      msg.response = "Deleted " + key +
+                     " (seq: " + std::to_string(msg.sequence) +
+                     ", ts: " + std::to_string(msg.timestamp) + ")";
 
     } else if (msg.cmd == CMD_SYNC) {
       int fromSeq = msg.sequence;
-      std::cout << "[LEADER-BONUS] Sync request from seq " << fromSeq
-                << std::endl;
+      LOG_DEBUG("[LEADER-BONUS] Sync request from seq " << fromSeq);
       std::lock_guard<std::mutex> lock(logMutex);
       for (const auto &op : operationLog) {
         if (op.sequence > fromSeq) {
-          send(clientSocket, (char *)&op, sizeof(Message), 0);
+          sendMessage(clientSocket, op);
         }
       }
       Message syncDone;
@@ -103,29 +106,28 @@ void handleClient(int clientSocket) {
       syncDone.sequence = logSequence;
       msg = syncDone;
     }
-    send(clientSocket, (char *)&msg, sizeof(Message), 0);
+    sendMessage(clientSocket, msg);
   }
   close(clientSocket);
 }
 
 void handleFollower(int followerSocket) {
   Message syncMsg;
-  if (recv(followerSocket, (char *)&syncMsg, sizeof(Message), 0) > 0) {
+  if (recvMessage(followerSocket, syncMsg)) {
     if (syncMsg.cmd == CMD_SYNC) {
       int fromSeq = syncMsg.sequence;
-      std::cout << "[LEADER-BONUS] New follower syncing from seq " << fromSeq
-                << std::endl;
+      LOG_INFO("[LEADER-BONUS] New follower syncing from seq " << fromSeq);
       std::lock_guard<std::mutex> lock(logMutex);
       for (const auto &op : operationLog) {
         if (op.sequence > fromSeq) {
-          send(followerSocket, (char *)&op, sizeof(Message), 0);
+          sendMessage(followerSocket, op);
           usleep(1000);
         }
       }
       Message ack;
       ack.cmd = CMD_ACK;
       ack.sequence = logSequence;
-      send(followerSocket, (char *)&ack, sizeof(Message), 0);
+      sendMessage(followerSocket, ack);
     }
   }
   {
@@ -170,8 +172,7 @@ int main() {
   bind(clientSocket, (struct sockaddr *)&clientAddr, sizeof(clientAddr));
   listen(clientSocket, 10);
 
-  std::cout << "[LEADER-BONUS] Listening on 8000 (Client) and 8080 (Follower)"
-            << std::endl;
+  LOG_INFO("[LEADER-BONUS] Listening on 8000 (Client) and 8080 (Follower)");
 
   while (true) {
     struct sockaddr_in addr;